@@ -1,6 +1,8 @@
 
+#define _GNU_SOURCE
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -11,6 +13,7 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 //#include <endian.h>
 #include "tmc.h"
 
@@ -461,6 +464,79 @@ static int set_timeout(unsigned int tmo)
 
 const size_t MAX_BL = 1024;
 
+#define CAPTURE_CHUNK (64*1024)
+
+/* returns used cpu time (user + system) of process in us */
+static double get_cpu_usec()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec*1e6 + ru.ru_utime.tv_usec +
+		ru.ru_stime.tv_sec*1e6 + ru.ru_stime.tv_usec;
+}
+
+/* Returns 1 if the last read ended with EOM, 0 if not or -1 on error */
+static int msg_in_eom()
+{
+	__u8 attr;
+
+	if (ioctl(fd, USBTMC_IOCTL_MSG_IN_ATTR, &attr) < 0)
+		return -1;
+	return attr & 1;
+}
+
+/* Reads the pending response in chunks until EOM and stores it in file
+ * out. Returns number of captured bytes or -1 on error.
+ */
+static long capture_to_disk(int out, int use_splice, char *buffer)
+{
+	long total = 0;
+	ssize_t len;
+	int pipefd[2];
+	int eom = 0;
+
+	if (use_splice && pipe(pipefd) < 0)
+		return -1;
+	do {
+		if (use_splice) {
+			len = splice(fd, NULL, pipefd[1], NULL, CAPTURE_CHUNK, 0);
+			if (len > 0 && splice(pipefd[0], NULL, out, NULL, len, 0) != len)
+				len = -1;
+		} else {
+			len = read(fd, buffer, CAPTURE_CHUNK);
+			if (len > 0 && write(out, buffer, len) != len)
+				len = -1;
+		}
+		if (len < 0)
+			break;
+		total += len;
+		eom = msg_in_eom();
+		if (eom < 0)
+			len = -1;
+	} while (len > 0 && !eom);
+	if (use_splice) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	return (len < 0) ? -1 : total;
+}
+
+/* Reader thread of full duplex test: reads the pending response */
+struct reader_args {
+	char *buffer;
+	__u32 max_len;
+	__u32 received;
+	int rv;
+};
+
+static void *reader_thread(void *arg)
+{
+	struct reader_args *args = arg;
+
+	args->rv = tmc_read(args->buffer, args->max_len, &args->received);
+	return NULL;
+}
+
 static void any_system_error()
 {
   char buf[MAX_BL];
@@ -529,6 +605,22 @@ int main () {
   time = getTS_usec();
   printf("*OPC? Latency = %.0f us per call with raw read/write functions\n", time/10.0);
 
+  {
+	struct usbtmc_query query;
+
+	query.out_size = 6;
+	query.in_size = 10;
+	query.out_message = "*OPC?\n";
+	query.in_message = sBigReceive;
+	getTS_usec(); /* initialize time stamp */
+	for (i = 0; i < 10; i++) {
+		rv = ioctl(fd, USBTMC_IOCTL_QUERY, &query);
+		assert(rv == 0);
+	}
+	time = getTS_usec();
+	printf("*OPC? Latency = %.0f us per call with USBTMC_IOCTL_QUERY\n", time/10.0);
+  }
+
   puts("*******************************************************************");
   puts("2a. Send and receive 3 MB data with raw read/write");
   bigsize = 3 * 1024 * 1024;
@@ -699,6 +791,72 @@ int main () {
 	any_system_error();
   }
   
+  puts("*******************************************************************");
+  puts("4. Capture 3 MB response to disk with read/write and splice");
+  bigsize = 3 * 1024 * 1024;
+  digits = sprintf( buf, "%u", bigsize );
+  n = sprintf( sBigSend,":MMEM:DATA 'test.txt',#%u%s", digits, buf );
+  for (i = 0; i < bigsize; i++) 
+	sBigSend[n+i] = (char)i+first_ascii;
+  sent = write(fd, sBigSend, n+bigsize);
+  assert(sent == (n+bigsize));
+  any_system_error(); /* wait until file is written */
+  for (k = 0; k < 2; k++) {
+	long captured;
+	double cpu;
+	int out = open("/tmp/usbtmc_capture.bin", O_WRONLY|O_CREAT|O_TRUNC, 0644);
+
+	assert(out >= 0);
+	tmc_send("mmem:data? 'test.txt'");
+	getTS_usec(); /* initialize time stamp */
+	cpu = get_cpu_usec();
+	captured = capture_to_disk(out, k, sBigReceive);
+	time = getTS_usec();
+	cpu = get_cpu_usec() - cpu;
+	close(out);
+	if (captured < 0)
+		printf("Error in capture_to_disk: %d\n", errno);
+	assert(captured >= bigsize);
+	printf("%s: size=%ld time %.0f us, rate=%.3f MB/s, cpu %.0f us\n",
+		k ? "splice    " : "read/write",
+		captured, time, captured * (1.0e6/(1024*1024)) / time, cpu);
+	any_system_error();
+  }
+
+  puts("*******************************************************************");
+  puts("5. Read 3 MB response while sending 3 MB data in another thread");
+  /* test.txt holds bigsize bytes of section 4 */
+  n = sprintf( sBigSend,":MMEM:DATA 'test2.txt',#%u%s", digits, buf );
+  for (k = 0; k < 2; k++) {
+	struct reader_args args;
+	pthread_t reader;
+
+	args.buffer = sBigReceive;
+	args.max_len = bigsize + MAX_BL;
+	tmc_send("mmem:data? 'test.txt'");
+	getTS_usec(); /* initialize time stamp */
+	if (k == 0) {
+		/* sequential: read response, then send data */
+		reader_thread(&args);
+		sent = write(fd, sBigSend, n+bigsize);
+	} else {
+		/* full duplex: both bulk endpoints are busy at the same time */
+		rv = pthread_create(&reader, NULL, reader_thread, &args);
+		assert(rv == 0);
+		sent = write(fd, sBigSend, n+bigsize);
+		pthread_join(reader, NULL);
+	}
+	time = getTS_usec();
+	if (args.rv < 0 || sent != (n+bigsize))
+		printf("Error in full duplex test: %d\n", errno);
+	assert(args.received >= bigsize);
+	assert(sent == (n+bigsize));
+	printf("%s: size=2*%d time %.0f us, rate=%.3f MB/s\n",
+		k ? "threads   " : "sequential",
+		bigsize, time, 2 * bigsize * (1.0e6/(1024*1024)) / time);
+	any_system_error();
+  }
+
   printf("done\n");
   close(fd);
   exit(0);
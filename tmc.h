@@ -68,6 +68,8 @@ struct usbtmc_termchar {
 #define USBTMC_FLAG_ASYNC		0x0001
 #define USBTMC_FLAG_APPEND		0x0002
 #define USBTMC_FLAG_IGNORE_TRAILER	0x0004
+/* whole transfer is bounded by the timeout instead of each urb */
+#define USBTMC_FLAG_DEADLINE		0x0008
 
 struct usbtmc_message {
 	__u32 transfer_size; /* size of bytes to transfer */
@@ -76,6 +78,147 @@ struct usbtmc_message {
 	void __user *message; /* pointer to header and data in user space */
 } __attribute__ ((packed));
 
+struct usbtmc_ring {
+	__u32 num_buffers; /* number of buffers in ring */
+	__u32 buffer_size; /* size of each buffer (= urb buffer size) */
+} __attribute__ ((packed));
+
+struct usbtmc_ring_read {
+	__u32 transfer_size; /* size of bytes to transfer */
+	__u32 transferred; /* size of received bytes in ring buffer */
+	__u32 flags; /* bit 0: 0 = synchronous; 1 = asynchronous */
+	__u32 index; /* index of ring buffer holding the received data */
+} __attribute__ ((packed));
+
+struct usbtmc_query {
+	__u32 out_size; /* size of command bytes to send */
+	__u32 in_size; /* max size of response bytes to receive */
+	__u32 transferred; /* size of received response bytes */
+	__u8 bmTransferAttributes; /* of response, bit 0: EOM */
+	__u8 tag; /* bTag of request, see USBTMC_IOCTL_QUERY_SUBMIT */
+	__u8 reserved[2];
+	void __user *out_message; /* pointer to command in user space */
+	void __user *in_message; /* pointer to response buffer in user space */
+} __attribute__ ((packed));
+
+struct usbtmc_batch_msg {
+	struct usbtmc_query query; /* in_size = 0: command without response */
+	__s32 status; /* result of the message */
+} __attribute__ ((packed));
+
+struct usbtmc_batch {
+	__u32 count; /* number of messages */
+	struct usbtmc_batch_msg __user *msgs; /* array of messages */
+} __attribute__ ((packed));
+
+struct usbtmc_stream_config {
+	__u32 num_urbs; /* number of urbs in flight (1 ... 16) */
+	__u32 fifo_size; /* power of 2, 64 kB ... 64 MB */
+} __attribute__ ((packed));
+
+struct usbtmc_stream_stats {
+	__u64 bytes; /* number of bytes stored in fifo */
+	__u64 dropped; /* number of bytes dropped due to full fifo */
+	__u32 high_water; /* max fill level of fifo */
+	__u32 fifo_size; /* size of fifo */
+	__u32 fifo_level; /* current fill level of fifo */
+	__s32 status; /* first error of stream */
+} __attribute__ ((packed));
+
+struct usbtmc_periodic_config {
+	__u32 interval_us; /* period of the query, >= 125 us */
+	__u32 in_size; /* max size of each response */
+	__u32 fifo_size; /* power of 2, 64 kB ... 64 MB */
+	__u32 out_size; /* size of command bytes to send */
+	void __user *out_message; /* pointer to command in user space */
+} __attribute__ ((packed));
+
+/*
+ * Record of USBTMC_IOCTL_PERIODIC_READ. Each record is followed by in_size
+ * bytes, of which the first size bytes hold the response.
+ */
+struct usbtmc_sample {
+	__u64 timestamp; /* ktime_get() in ns when the query was sent */
+	__u32 seq; /* number of the period, gaps show lost samples */
+	__s32 status; /* 0 or error code of the query */
+	__u32 size; /* size of the response */
+	__u8 bmTransferAttributes; /* of response, bit 0: EOM */
+	__u8 reserved[3];
+} __attribute__ ((packed));
+
+struct usbtmc_periodic_stats {
+	__u64 samples; /* number of samples stored in fifo */
+	__u64 dropped; /* number of samples dropped due to full fifo */
+	__u64 busy; /* number of periods skipped due to other transfers */
+	__u32 periods; /* number of elapsed periods */
+	__u32 fifo_size; /* size of fifo */
+	__u32 fifo_level; /* current fill level of fifo */
+	__u32 reserved;
+} __attribute__ ((packed));
+
+struct usbtmc_srq_event {
+	__u64 timestamp; /* ktime_get() of SRQ notification in ns */
+	__u8 stb; /* status byte of SRQ notification */
+	__u8 reserved[7];
+} __attribute__ ((packed));
+
+struct usbtmc_srq_events {
+	__u32 count; /* in: size of array events, out: number of events */
+	__u32 lost; /* number of events lost due to full queue */
+	struct usbtmc_srq_event __user *events; /* oldest event first */
+} __attribute__ ((packed));
+
+/* time stamps of the last read in ns, see ktime_get() */
+struct usbtmc_msg_in_time {
+	__u64 first; /* reception of first Bulk-IN packet */
+	__u64 last; /* reception of last Bulk-IN packet */
+} __attribute__ ((packed));
+
+/* performance counters of a file handle since open */
+struct usbtmc_stats {
+	__u64 bytes_in; /* received bytes including headers */
+	__u64 bytes_out; /* sent bytes including headers */
+	__u64 urbs_submitted; /* asynchronous bulk urbs */
+	__u64 urbs_completed;
+	__u64 short_packets; /* Bulk-IN urbs not completely filled */
+	__u64 timeouts; /* requests failed with ETIMEDOUT */
+	__u64 aborts; /* ABORT_BULK_IN/OUT sequences */
+	__u64 srqs; /* received SRQ notifications */
+	__u64 clears; /* CLEAR sequences */
+	__u64 max_urbs_in_flight; /* max number of submitted bulk urbs */
+} __attribute__ ((packed));
+
+/* events of USBTMC_IOCTL_SET_EVENTFD */
+#define USBTMC_EVENT_SRQ		0 /* SRQ notification received */
+#define USBTMC_EVENT_IN_READY		1 /* Bulk-IN data received */
+#define USBTMC_EVENT_OUT_DONE		2 /* all Bulk-OUT urbs are sent */
+
+struct usbtmc_eventfd {
+	__u32 event; /* USBTMC_EVENT_... */
+	__s32 fd; /* eventfd to signal or -1 to unregister */
+} __attribute__ ((packed));
+
+/* sequences of USBTMC_IOCTL_RECOVERY_START */
+#define USBTMC_RECOVERY_CLEAR		0
+#define USBTMC_RECOVERY_ABORT_BULK_IN	1
+#define USBTMC_RECOVERY_ABORT_BULK_OUT	2
+
+/* usbtmc_recovery->flags */
+#define USBTMC_RECOVERY_TAG		0x01 /* use tag instead of last bTag */
+
+struct usbtmc_recovery {
+	__u8 type; /* USBTMC_RECOVERY_... */
+	__u8 flags;
+	__u8 tag; /* bTag of the transfer to abort */
+	__u32 timeout; /* RECOVERY_RESULT: max wait in ms, 0 = no wait */
+	__s32 status; /* RECOVERY_RESULT: 0, -EINPROGRESS or error code */
+} __attribute__ ((packed));
+
+/* command area of an IORING_OP_URING_CMD SQE, see README.md */
+struct usbtmc_uring_cmd {
+	__u64 arg; /* pointer to usbtmc_message or usbtmc_query */
+} __attribute__ ((packed));
+
 /* Request values for USBTMC driver's ioctl entry point */
 #define USBTMC_IOC_NR			91
 #define USBTMC_IOCTL_INDICATOR_PULSE	_IO(USBTMC_IOC_NR, 1)
@@ -115,6 +258,42 @@ struct usbtmc_message {
 #define USBTMC_IOCTL_CANCEL_IO		_IO(USBTMC_IOC_NR, 35)
 #define USBTMC_IOCTL_CLEANUP_IO		_IO(USBTMC_IOC_NR, 36)
 
+/* Get/set size of urb buffers used for bulk transfers */
+#define USBTMC_IOCTL_GET_BUFSIZE	_IOR(USBTMC_IOC_NR, 37, __u32)
+#define USBTMC_IOCTL_SET_BUFSIZE	_IOW(USBTMC_IOC_NR, 38, __u32)
+
+/* mmap()-able receive ring */
+#define USBTMC_IOCTL_RING_ALLOC		_IOWR(USBTMC_IOC_NR, 39, struct usbtmc_ring)
+#define USBTMC_IOCTL_RING_READ		_IOWR(USBTMC_IOC_NR, 40, struct usbtmc_ring_read)
+#define USBTMC_IOCTL_RING_RELEASE	_IOW(USBTMC_IOC_NR, 41, __u32)
+#define USBTMC_IOCTL_QUERY		_IOWR(USBTMC_IOC_NR, 42, struct usbtmc_query)
+#define USBTMC_IOCTL_BATCH		_IOW(USBTMC_IOC_NR, 43, struct usbtmc_batch)
+/* streaming mode */
+#define USBTMC_IOCTL_STREAM_START	_IOW(USBTMC_IOC_NR, 44, struct usbtmc_stream_config)
+#define USBTMC_IOCTL_STREAM_STOP	_IO(USBTMC_IOC_NR, 45)
+#define USBTMC_IOCTL_STREAM_READ	_IOWR(USBTMC_IOC_NR, 46, struct usbtmc_message)
+#define USBTMC_IOCTL_STREAM_STATS	_IOR(USBTMC_IOC_NR, 47, struct usbtmc_stream_stats)
+/* asynchronous queries */
+#define USBTMC_IOCTL_QUERY_SUBMIT	_IOWR(USBTMC_IOC_NR, 48, struct usbtmc_query)
+#define USBTMC_IOCTL_QUERY_RESULT	_IOWR(USBTMC_IOC_NR, 49, struct usbtmc_query)
+#define USBTMC488_IOCTL_READ_SRQ_EVENTS	_IOWR(USBTMC_IOC_NR, 50, struct usbtmc_srq_events)
+#define USBTMC_IOCTL_SET_EVENTFD	_IOW(USBTMC_IOC_NR, 51, struct usbtmc_eventfd)
+#define USBTMC_IOCTL_MSG_IN_TIME	_IOR(USBTMC_IOC_NR, 52, struct usbtmc_msg_in_time)
+#define USBTMC_IOCTL_GET_STATS		_IOR(USBTMC_IOC_NR, 53, struct usbtmc_stats)
+/* Get/set whole transfer deadline in ns, 0 = per urb timeout */
+#define USBTMC_IOCTL_GET_DEADLINE	_IOR(USBTMC_IOC_NR, 54, __u64)
+#define USBTMC_IOCTL_SET_DEADLINE	_IOW(USBTMC_IOC_NR, 55, __u64)
+/* CLEAR and ABORT sequences running in the background */
+#define USBTMC_IOCTL_RECOVERY_START	_IOW(USBTMC_IOC_NR, 56, struct usbtmc_recovery)
+#define USBTMC_IOCTL_RECOVERY_RESULT	_IOWR(USBTMC_IOC_NR, 57, struct usbtmc_recovery)
+/* Read ahead responses of max size bytes after an SRQ with MAV, 0 = off */
+#define USBTMC488_IOCTL_MAV_PREFETCH	_IOW(USBTMC_IOC_NR, 58, __u32)
+/* periodic query scheduler */
+#define USBTMC_IOCTL_PERIODIC_START	_IOW(USBTMC_IOC_NR, 59, struct usbtmc_periodic_config)
+#define USBTMC_IOCTL_PERIODIC_STOP	_IO(USBTMC_IOC_NR, 60)
+#define USBTMC_IOCTL_PERIODIC_READ	_IOWR(USBTMC_IOC_NR, 61, struct usbtmc_message)
+#define USBTMC_IOCTL_PERIODIC_STATS	_IOR(USBTMC_IOC_NR, 62, struct usbtmc_periodic_stats)
+
 /* Driver encoded usb488 capabilities */
 #define USBTMC488_CAPABILITY_TRIGGER         1
 #define USBTMC488_CAPABILITY_SIMPLE          2
@@ -31,16 +31,32 @@
 #include <linux/poll.h>
 #include <linux/mutex.h>
 #include <linux/usb.h>
+#include <linux/usb/hcd.h>
 #include <linux/compiler.h>
 #include <linux/compat.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/completion.h>
+#include <linux/io_uring/cmd.h>
+#include <linux/kthread.h>
+#include <linux/sched/mm.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/eventfd.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "tmc.h"
 
+#define CREATE_TRACE_POINTS
+#include "usbtmc_trace.h"
+
 #define VERBOSE 0
 
 /* Increment API VERSION when changing tmc.h with new flags or ioctls
  * or when changing a significant behavior of the driver.
  */
-#define USBTMC_API_VERSION (2)
+#define USBTMC_API_VERSION (3)
 
 #define USBTMC_HEADER_SIZE	12
 #define USBTMC_MINOR_BASE	176
@@ -49,11 +65,58 @@
 #define USBTMC_MIN_TIMEOUT	100
 /* Default USB timeout (in milliseconds) */
 #define USBTMC_TIMEOUT		5000
+/* Limits of USBTMC_IOCTL_SET_DEADLINE (in nanoseconds) */
+#define USBTMC_MIN_DEADLINE	(100 * NSEC_PER_USEC)
+#define USBTMC_MAX_DEADLINE	((u64)U32_MAX * NSEC_PER_MSEC)
 
 /* Max number of urbs used in write transfers */
 #define MAX_URBS_IN_FLIGHT	16
-/* I/O buffer size used in generic read/write functions */
+/* Default I/O buffer size used in generic read/write functions */
 #define USBTMC_BUFSIZE		(4096)
+/* Max I/O buffer size that can be set with USBTMC_IOCTL_SET_BUFSIZE */
+#define USBTMC_MAX_BUFSIZE	(1024 * 1024)
+
+/*
+ * Synchronous writes of at least USBTMC_SG_MIN_SIZE bytes are sent directly
+ * from the pinned user pages with scatter-gather urbs of max
+ * USBTMC_SG_MAX_SIZE bytes, if the host controller supports it. Up to
+ * USBTMC_SG_URBS of these urbs are in flight.
+ */
+#define USBTMC_SG_MIN_SIZE	(64 * 1024)
+#define USBTMC_SG_MAX_SIZE	(1024 * 1024)
+#define USBTMC_SG_MAX_PAGES	(USBTMC_SG_MAX_SIZE / PAGE_SIZE + 1)
+#define USBTMC_SG_URBS		4
+
+/* Limits of the streaming mode, see USBTMC_IOCTL_STREAM_START */
+#define USBTMC_MIN_STREAM_FIFO	(64 * 1024)
+#define USBTMC_MAX_STREAM_FIFO	(64 * 1024 * 1024)
+
+/* Min period of USBTMC_IOCTL_PERIODIC_START (one microframe) */
+#define USBTMC_MIN_PERIODIC_INTERVAL	125
+
+/* Max number of outstanding requests of USBTMC_IOCTL_QUERY_SUBMIT */
+#define USBTMC_MAX_PENDING	8
+/* Max response size of USBTMC_IOCTL_QUERY_SUBMIT */
+#define USBTMC_MAX_PENDING_SIZE	(16 * 1024 * 1024)
+
+/*
+ * Number of buckets of the latency histograms. Bucket n > 0 counts
+ * intervals of 2^(n-1) ... 2^n - 1 ns, the last one all longer ones.
+ */
+#define USBTMC_HIST_BUCKETS	40
+
+/* Size of the SRQ event queue of each file handle (power of 2) */
+#define USBTMC_SRQ_EVENTS	32
+
+/* Number of events of USBTMC_IOCTL_SET_EVENTFD */
+#define USBTMC_EVENTFDS		(USBTMC_EVENT_OUT_DONE + 1)
+
+/* Max number of messages of USBTMC_IOCTL_BATCH */
+#define USBTMC_MAX_BATCH_MSGS	256
+
+/* Limits of the mmap()-able receive ring, see USBTMC_IOCTL_RING_ALLOC */
+#define USBTMC_MAX_RING_BUFFERS	64
+#define USBTMC_MAX_RING_SIZE	(16 * 1024 * 1024)
 
 /*
  * Maximum number of read cycles to empty bulk in endpoint during CLEAR and
@@ -62,6 +125,13 @@
  */
 #define USBTMC_MAX_READS_TO_CLEAR_BULK_IN	100
 
+/* Message AVailable bit of the status byte, see IEEE 488.2 */
+#define USBTMC488_STB_MAV	0x10
+
+/* Delay between status polls of CLEAR and ABORT sequences (in ms) */
+#define USBTMC_RECOVERY_MIN_DELAY	1
+#define USBTMC_RECOVERY_MAX_DELAY	50
+
 static const struct usb_device_id usbtmc_devices[] = {
 	{ USB_INTERFACE_INFO(USB_CLASS_APP_SPEC, 3, 0), },
 	{ USB_INTERFACE_INFO(USB_CLASS_APP_SPEC, 3, 1), },
@@ -82,6 +152,67 @@ struct usbtmc_dev_capabilities {
 	__u8 usb488_device_capabilities;
 };
 
+/* Performance counters, see struct usbtmc_stats */
+enum usbtmc_stat {
+	USBTMC_STAT_BYTES_IN,
+	USBTMC_STAT_BYTES_OUT,
+	USBTMC_STAT_URBS_SUBMITTED,
+	USBTMC_STAT_URBS_COMPLETED,
+	USBTMC_STAT_SHORT_PACKETS,
+	USBTMC_STAT_TIMEOUTS,
+	USBTMC_STAT_ABORTS,
+	USBTMC_STAT_SRQS,
+	USBTMC_STAT_CLEARS,
+	USBTMC_STAT_LOCK_WAIT_NS,
+	USBTMC_STAT_MAX_IN_FLIGHT,
+	USBTMC_STATS
+};
+
+/*
+ * Counters of a device or a file handle. They are updated without lock
+ * from the completion handlers.
+ */
+struct usbtmc_counters {
+	atomic64_t value[USBTMC_STATS];
+	atomic_t in_flight; /* submitted bulk urbs */
+};
+
+/* Latency histograms, see debugfs file usbtmc/<interface>/latency */
+enum usbtmc_hist {
+	USBTMC_HIST_OUT,	/* write() submitted until all urbs sent */
+	USBTMC_HIST_RESPONSE,	/* REQUEST_DEV_DEP_MSG_IN until response */
+	USBTMC_HIST_TRANSFER,	/* first Bulk-IN packet until EOM */
+	USBTMC_HISTS
+};
+
+struct usbtmc_histogram {
+	atomic64_t bucket[USBTMC_HIST_BUCKETS];
+};
+
+/* states of the CLEAR and ABORT sequences, see usbtmc_recovery_step() */
+enum usbtmc_recovery_state {
+	USBTMC_RECOVERY_INITIATE,
+	USBTMC_RECOVERY_CHECK_STATUS,
+	USBTMC_RECOVERY_READ_BULK_IN,
+	USBTMC_RECOVERY_CLEAR_HALT,
+	USBTMC_RECOVERY_DONE,
+};
+
+struct usbtmc_recovery_seq {
+	u8 type; /* USBTMC_RECOVERY_CLEAR, _ABORT_BULK_IN or _ABORT_BULK_OUT */
+	u8 tag;
+	enum usbtmc_recovery_state state;
+	unsigned int n; /* number of status polls and Bulk-IN reads */
+	unsigned int delay; /* ms until the next step */
+	unsigned int backoff; /* ms between status polls */
+	u8 *buffer;
+
+	/* data of USBTMC_IOCTL_RECOVERY_START */
+	struct delayed_work work;
+	wait_queue_head_t wait;
+	int result; /* -EINPROGRESS while the work is running */
+};
+
 /* This structure holds private data for each USBTMC device. One copy is
  * allocated for each USBTMC device in the driver's probe function.
  */
@@ -101,6 +232,9 @@ struct usbtmc_device_data {
 	/* packet size of IN bulk */
 	u16            wMaxPacketSize;
 
+	/* default urb buffer size for new file handles */
+	u32            bufsize;
+
 	/* data for interrupt in endpoint handling */
 	u8             bNotify1;
 	u8             bNotify2;
@@ -118,16 +252,69 @@ struct usbtmc_device_data {
 	__u8 usb488_caps;
 
 	bool zombie; /* fd of disconnected device */
+	bool suspended; /* between suspend and resume, protected by in_mutex */
 
 	struct usbtmc_dev_capabilities	capabilities;
 	struct kref kref;
-	struct mutex io_mutex;	/* only one i/o function running at a time */
-	wait_queue_head_t waitq;
+	/*
+	 * Lock order: in_mutex, out_mutex, abort_mutex, ctrl_mutex, io_mutex.
+	 * Disconnect, suspend and reset take all of them.
+	 */
+	struct mutex in_mutex;	/* Bulk-IN transfers and their file state */
+	struct mutex out_mutex;	/* Bulk-OUT transfers and bTag */
+	struct mutex abort_mutex; /* CLEAR and ABORT sequences */
+	struct mutex ctrl_mutex; /* short control requests and iin_bTag */
+	struct mutex io_mutex;	/* file list and file settings */
+	wait_queue_head_t waitq; /* READ_STB waiting for interrupt in */
 	struct fasync_struct *fasync;
 	spinlock_t dev_lock; /* lock for file_list */
+
+	/* ordered queue for asynchronous read_iter/write_iter requests */
+	struct workqueue_struct *iocb_wq;
+
+	/* sum of all file handles, see sysfs group "stats" */
+	struct usbtmc_counters counters;
+
+	struct dentry *debugfs_dir;
+	struct usbtmc_histogram hist[USBTMC_HISTS];
+
+	/*
+	 * requests of USBTMC_IOCTL_QUERY_SUBMIT of all file handles,
+	 * protected by in_mutex. Their responses are queued on the device,
+	 * so no other Bulk-IN transfer is allowed.
+	 */
+	int pending_count;
+
+	/*
+	 * file handle with USBTMC488_IOCTL_MAV_PREFETCH, protected by
+	 * dev_lock. An SRQ with MAV announces one response of the device,
+	 * so only one file handle may read it ahead.
+	 */
+	struct usbtmc_file_data *prefetch_file;
+	atomic_t prefetch_srq; /* SRQ with MAV received */
+
+	/*
+	 * a DEV_DEP_MSG_OUT with EOM was sent and the response, if any, is
+	 * not read yet. usbtmc_periodic_work must not send a query then.
+	 */
+	atomic_t response_pending;
+
+	/* sequence of USBTMC_IOCTL_RECOVERY_START, protected by abort_mutex */
+	struct usbtmc_recovery_seq recovery;
 };
 #define to_usbtmc_data(d) container_of(d, struct usbtmc_device_data, kref)
 
+/* outstanding REQUEST_DEV_DEP_MSG_IN of USBTMC_IOCTL_QUERY_SUBMIT */
+struct usbtmc_pending {
+	u8 tag; /* bTag of request, 0 = entry unused */
+	bool done; /* response received or failed */
+	u8 attributes; /* bmTransferAttributes of response */
+	int status;
+	u32 in_size; /* requested size */
+	u32 size; /* size of received response */
+	u8 *data; /* received response */
+};
+
 /*
  * This structure holds private data for each USBTMC file handle.
  */
@@ -136,8 +323,12 @@ struct usbtmc_file_data {
 	struct list_head file_elem;
 
 	u32            timeout;
-	u8             srq_byte;
-	atomic_t       srq_asserted;
+	u64            deadline_ns; /* whole transfer timeout, 0 = off */
+	u32            bufsize; /* size of each bulk urb buffer */
+	/* received SRQ notifications, protected by dev_lock */
+	DECLARE_KFIFO(srq_fifo, struct usbtmc_srq_event, USBTMC_SRQ_EVENTS);
+	u32            srq_lost; /* events lost due to full srq_fifo */
+	atomic_t       srq_asserted; /* srq_fifo is not empty */
 	atomic_t       closing;
 	u8             bmTransferAttributes; /* member of DEV_DEP_MSG_IN */
 
@@ -146,32 +337,243 @@ struct usbtmc_file_data {
 	bool           term_char_enabled;
 	bool           auto_abort;
 
-	spinlock_t     err_lock; /* lock for errors */
+	spinlock_t     err_lock; /* lock for errors and eventfd */
+
+	/* eventfds signaled by the completion handlers */
+	struct eventfd_ctx *eventfd[USBTMC_EVENTFDS];
 
 	struct usb_anchor submitted;
 
+	/* pool of urbs with coherent dma buffers of bufsize bytes */
+	struct usb_anchor urb_pool;
+	atomic_t pool_size; /* number of urbs allocated for the pool */
+
+	/* Bulk-OUT urbs while the ring replaces the buffers of the pool */
+	struct usb_anchor out_pool;
+
+	/* mmap()-able ring replacing the buffers of the pool */
+	u8 *ring_buffer;
+	dma_addr_t ring_dma;
+	u32 ring_size; /* number of buffers */
+	struct urb **ring_urbs;
+	DECLARE_BITMAP(ring_loaned, USBTMC_MAX_RING_BUFFERS); /* owned by user */
+
 	/* data for generic_write */
 	struct semaphore limit_write_sem;
 	u32 out_transfer_size;
 	int out_status;
+	ktime_t out_done_time; /* completion of last Bulk-OUT urb */
+	ktime_t request_time; /* completion of last REQUEST_DEV_DEP_MSG_IN */
 
 	/* data for generic_read */
 	u32 in_transfer_size;
+	ktime_t in_first_time; /* reception of first and last Bulk-IN urb */
+	ktime_t in_last_time;
 	int in_status;
 	int in_urbs_used;
-	struct usb_anchor in_anchor;
+	struct usb_anchor in_submitted; /* submitted Bulk-IN urbs */
+	struct usb_anchor in_anchor; /* received Bulk-IN urbs */
+
+	/* data for streaming mode */
+	bool streaming;
+	struct usb_anchor stream_anchor; /* urbs resubmitted by callback */
+	struct kfifo stream_fifo;
+	void *stream_buffer;
+	int stream_status;
+	u64 stream_bytes;
+	u64 stream_dropped;
+	u32 stream_high_water;
+
+	/* outstanding requests of USBTMC_IOCTL_QUERY_SUBMIT */
+	struct usbtmc_pending pending[USBTMC_MAX_PENDING];
+	int pending_count;
 	wait_queue_head_t wait_bulk_in;
+	/* poll and SRQ waiters of this file handle */
+	wait_queue_head_t waitq;
+
+	/* see USBTMC_IOCTL_GET_STATS */
+	struct usbtmc_counters counters;
+
+	/* read ahead after an SRQ with MAV, see USBTMC488_IOCTL_MAV_PREFETCH */
+	u32 prefetch_size; /* max response size, 0 = disabled */
+	struct work_struct prefetch_work;
+	struct usbtmc_pending prefetch;
+	u32 prefetch_pos; /* bytes already returned by read() */
+
+	/* periodic query scheduler, see USBTMC_IOCTL_PERIODIC_START */
+	bool periodic;
+	struct hrtimer periodic_timer;
+	ktime_t periodic_interval;
+	atomic_t periodic_ticks; /* elapsed periods */
+	struct work_struct periodic_work;
+	u8 *periodic_command; /* DEV_DEP_MSG_OUT with header */
+	u32 periodic_out_size; /* size of periodic_command */
+	u32 periodic_in_size;
+	struct usbtmc_sample *periodic_sample; /* record of the work */
+	struct kfifo periodic_fifo; /* records of all samples */
+	void *periodic_buffer;
+	/* counters of USBTMC_IOCTL_PERIODIC_STATS, protected by err_lock */
+	u64 periodic_samples; /* samples stored in fifo */
+	u64 periodic_dropped; /* samples dropped due to full fifo */
+	u64 periodic_busy; /* periods skipped due to other transfers */
 };
 
 /* Forward declarations */
 static struct usb_driver usbtmc_driver;
+static struct dentry *usbtmc_debugfs_root;
 static void usbtmc_draw_down(struct usbtmc_file_data *file_data);
+static void usbtmc_free_pool(struct usbtmc_file_data *file_data);
+static void usbtmc_prefetch_work(struct work_struct *work);
+static enum hrtimer_restart usbtmc_periodic_timer(struct hrtimer *timer);
+static void usbtmc_periodic_work(struct work_struct *work);
+static void usbtmc_periodic_stop(struct usbtmc_file_data *file_data);
+static int usbtmc_submit_request(struct usbtmc_file_data *file_data,
+				 u32 transfer_size);
+
+/* locks of usbtmc_lock(), see struct usbtmc_device_data for the order */
+#define USBTMC_LOCK_IN		BIT(0)
+#define USBTMC_LOCK_OUT		BIT(1)
+#define USBTMC_LOCK_ABORT	BIT(2)
+#define USBTMC_LOCK_CTRL	BIT(3)
+#define USBTMC_LOCK_IO		BIT(4)
+#define USBTMC_LOCK_ALL		(USBTMC_LOCK_IN | USBTMC_LOCK_OUT | \
+				 USBTMC_LOCK_ABORT | USBTMC_LOCK_CTRL | \
+				 USBTMC_LOCK_IO)
+
+/*
+ * Takes a mutex and adds the time waited for a contended mutex to the
+ * lock_wait_ns counter of the device.
+ */
+static void usbtmc_mutex_lock(struct usbtmc_device_data *data,
+			      struct mutex *lock)
+{
+	ktime_t start;
+
+	if (mutex_trylock(lock))
+		return;
+
+	start = ktime_get();
+	mutex_lock(lock);
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		     &data->counters.value[USBTMC_STAT_LOCK_WAIT_NS]);
+}
+
+static void usbtmc_lock(struct usbtmc_device_data *data, unsigned int locks)
+{
+	if (locks & USBTMC_LOCK_IN)
+		usbtmc_mutex_lock(data, &data->in_mutex);
+	if (locks & USBTMC_LOCK_OUT)
+		usbtmc_mutex_lock(data, &data->out_mutex);
+	if (locks & USBTMC_LOCK_ABORT)
+		usbtmc_mutex_lock(data, &data->abort_mutex);
+	if (locks & USBTMC_LOCK_CTRL)
+		usbtmc_mutex_lock(data, &data->ctrl_mutex);
+	if (locks & USBTMC_LOCK_IO)
+		usbtmc_mutex_lock(data, &data->io_mutex);
+}
+
+static void usbtmc_unlock(struct usbtmc_device_data *data, unsigned int locks)
+{
+	if (locks & USBTMC_LOCK_IO)
+		mutex_unlock(&data->io_mutex);
+	if (locks & USBTMC_LOCK_CTRL)
+		mutex_unlock(&data->ctrl_mutex);
+	if (locks & USBTMC_LOCK_ABORT)
+		mutex_unlock(&data->abort_mutex);
+	if (locks & USBTMC_LOCK_OUT)
+		mutex_unlock(&data->out_mutex);
+	if (locks & USBTMC_LOCK_IN)
+		mutex_unlock(&data->in_mutex);
+}
+
+/* Adds n to a counter of the file handle and of the device */
+static void usbtmc_count(struct usbtmc_file_data *file_data,
+			 enum usbtmc_stat stat, s64 n)
+{
+	atomic64_add(n, &file_data->counters.value[stat]);
+	atomic64_add(n, &file_data->data->counters.value[stat]);
+}
+
+/*
+ * Called when a Bulk-IN transfer completed a message. SRQs with MAV
+ * received until now announced this message, so usbtmc_prefetch_work must
+ * not read ahead any more.
+ */
+static void usbtmc_msg_in_done(struct usbtmc_device_data *data)
+{
+	atomic_set(&data->prefetch_srq, 0);
+	atomic_set(&data->response_pending, 0);
+}
+
+/* Called when a DEV_DEP_MSG_OUT header is sent, see response_pending */
+static void usbtmc_msg_out_sent(struct usbtmc_device_data *data,
+				const u8 *header)
+{
+	if (header[0] == 1 && (header[8] & 1))
+		atomic_set(&data->response_pending, 1);
+}
+
+static void usbtmc_count_in_flight(struct usbtmc_counters *counters)
+{
+	atomic64_t *max = &counters->value[USBTMC_STAT_MAX_IN_FLIGHT];
+	s64 n = atomic_inc_return(&counters->in_flight);
+	s64 old = atomic64_read(max);
+
+	while (n > old && !atomic64_try_cmpxchg(max, &old, n))
+		;
+}
+
+/*
+ * Counts and traces a successfully submitted bulk urb. The urb may
+ * already be completed, so in_flight can be negative for a short time.
+ */
+static void usbtmc_urb_submitted(struct usbtmc_file_data *file_data,
+				 struct urb *urb)
+{
+	trace_usbtmc_urb_submit(&file_data->data->intf->dev, file_data, urb);
+	usbtmc_count(file_data, USBTMC_STAT_URBS_SUBMITTED, 1);
+	usbtmc_count_in_flight(&file_data->counters);
+	usbtmc_count_in_flight(&file_data->data->counters);
+}
+
+/* Counts and traces a completed bulk urb of the completion handlers */
+static void usbtmc_urb_completed(struct usbtmc_file_data *file_data,
+				 struct urb *urb)
+{
+	trace_usbtmc_urb_complete(&file_data->data->intf->dev, file_data, urb);
+	atomic_dec(&file_data->counters.in_flight);
+	atomic_dec(&file_data->data->counters.in_flight);
+	usbtmc_count(file_data, USBTMC_STAT_URBS_COMPLETED, 1);
+
+	if (usb_urb_dir_out(urb)) {
+		usbtmc_count(file_data, USBTMC_STAT_BYTES_OUT,
+			     urb->actual_length);
+		return;
+	}
+
+	usbtmc_count(file_data, USBTMC_STAT_BYTES_IN, urb->actual_length);
+	if (!urb->status &&
+	    urb->actual_length < urb->transfer_buffer_length)
+		usbtmc_count(file_data, USBTMC_STAT_SHORT_PACKETS, 1);
+}
+
+/* Adds the interval from start to end to a latency histogram */
+static void usbtmc_hist_add(struct usbtmc_device_data *data,
+			    enum usbtmc_hist hist, ktime_t start, ktime_t end)
+{
+	s64 ns = ktime_to_ns(ktime_sub(end, start));
+	unsigned int n = ns > 0 ? fls64(ns) : 0;
+
+	n = min_t(unsigned int, n, USBTMC_HIST_BUCKETS - 1);
+	atomic64_inc(&data->hist[hist].bucket[n]);
+}
 
 static void usbtmc_delete(struct kref *kref)
 {
 	struct usbtmc_device_data *data = to_usbtmc_data(kref);
 
 	pr_debug("%s - called\n", __func__);
+	destroy_workqueue(data->iocb_wq);
 	usb_put_dev(data->usb_dev);
 	kfree(data);
 }
@@ -195,10 +597,20 @@ static int usbtmc_open(struct inode *inode, struct file *filp)
 	pr_debug("%s - called\n", __func__);
 
 	spin_lock_init(&file_data->err_lock);
+	INIT_KFIFO(file_data->srq_fifo);
 	sema_init(&file_data->limit_write_sem, MAX_URBS_IN_FLIGHT);
 	init_usb_anchor(&file_data->submitted);
+	init_usb_anchor(&file_data->in_submitted);
+	init_usb_anchor(&file_data->urb_pool);
+	init_usb_anchor(&file_data->out_pool);
+	init_usb_anchor(&file_data->stream_anchor);
 	init_usb_anchor(&file_data->in_anchor);
 	init_waitqueue_head(&file_data->wait_bulk_in);
+	init_waitqueue_head(&file_data->waitq);
+	INIT_WORK(&file_data->prefetch_work, usbtmc_prefetch_work);
+	INIT_WORK(&file_data->periodic_work, usbtmc_periodic_work);
+	hrtimer_setup(&file_data->periodic_timer, usbtmc_periodic_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 
 	data = usb_get_intfdata(intf);
 	/* Protect reference to data from file structure until release */
@@ -210,6 +622,7 @@ static int usbtmc_open(struct inode *inode, struct file *filp)
 	atomic_set(&file_data->closing, 0);
 
 	file_data->timeout = USBTMC_TIMEOUT;
+	file_data->bufsize = data->bufsize;
 	file_data->term_char = '\n';
 	file_data->term_char_enabled = 0;
 	file_data->auto_abort = 0;
@@ -223,6 +636,8 @@ static int usbtmc_open(struct inode *inode, struct file *filp)
 
 	/* Store pointer in file structure's private data field */
 	filp->private_data = file_data;
+	/* asynchronous kiocbs are queued, see usbtmc_queue_iocb */
+	filp->f_mode |= FMODE_NOWAIT;
 
 	return 0;
 }
@@ -243,8 +658,9 @@ static int usbtmc_flush(struct file *file, fl_owner_t id)
 	data = file_data->data;
 
 	/* wait for io to stop */
-	mutex_lock(&data->io_mutex);
+	usbtmc_lock(data, USBTMC_LOCK_ALL);
 
+	usbtmc_periodic_stop(file_data);
 	usbtmc_draw_down(file_data);
 
 	spin_lock_irq(&file_data->err_lock);
@@ -255,9 +671,9 @@ static int usbtmc_flush(struct file *file, fl_owner_t id)
 	file_data->out_transfer_size = 0;
 	spin_unlock_irq(&file_data->err_lock);
 
-	wake_up_interruptible_all(&data->waitq);
+	wake_up_interruptible_all(&file_data->waitq);
 	pr_debug("%s - called\n", __func__);
-	mutex_unlock(&data->io_mutex);
+	usbtmc_unlock(data, USBTMC_LOCK_ALL);
 
 	return 0;
 }
@@ -265,9 +681,22 @@ static int usbtmc_flush(struct file *file, fl_owner_t id)
 static int usbtmc_release(struct inode *inode, struct file *file)
 {
 	struct usbtmc_file_data *file_data = file->private_data;
+	int i;
 
 	pr_debug("%s - called\n", __func__);
 
+	/* the works signal eventfds and take urbs of the pool */
+	hrtimer_cancel(&file_data->periodic_timer);
+	cancel_work_sync(&file_data->periodic_work);
+	usbtmc_periodic_stop(file_data);
+
+	spin_lock_irq(&file_data->data->dev_lock);
+	if (file_data->data->prefetch_file == file_data)
+		file_data->data->prefetch_file = NULL;
+	spin_unlock_irq(&file_data->data->dev_lock);
+	/* not queued any more by usbtmc_interrupt */
+	cancel_work_sync(&file_data->prefetch_work);
+
 	/* prevent IO _AND_ usbtmc_interrupt */
 	mutex_lock(&file_data->data->io_mutex);
 	spin_lock_irq(&file_data->data->dev_lock);
@@ -275,234 +704,528 @@ static int usbtmc_release(struct inode *inode, struct file *file)
 	list_del(&file_data->file_elem);
 
 	spin_unlock_irq(&file_data->data->dev_lock);
+
+	/* all urbs are back in the pool after usbtmc_flush */
+	usbtmc_free_pool(file_data);
+
+	for (i = 0; i < USBTMC_EVENTFDS; i++) {
+		if (file_data->eventfd[i])
+			eventfd_ctx_put(file_data->eventfd[i]);
+	}
 	mutex_unlock(&file_data->data->io_mutex);
 
+	kvfree(file_data->prefetch.data);
+
 	kref_put(&file_data->data->kref, usbtmc_delete);
 	file_data->data = NULL;
 	kfree(file_data);
 	return 0;
 }
 
-static int usbtmc_ioctl_abort_bulk_in_tag(struct usbtmc_device_data *data,
-					  u8 tag)
+/*
+ * CLEAR and ABORT_BULK_IN/OUT sequences are state machines. Each call of
+ * usbtmc_recovery_step() sends one control request or reads one Bulk-IN
+ * packet and sets the next state and the delay before the next step.
+ * USBTMC_IOCTL_CLEAR and USBTMC_IOCTL_ABORT_* run the steps synchronously,
+ * USBTMC_IOCTL_RECOVERY_START runs them in a delayed work item.
+ */
+static int usbtmc_recovery_ctrl(struct usbtmc_device_data *data,
+				struct usbtmc_recovery_seq *seq,
+				u8 request, u16 value, u16 size)
 {
-	u8 *buffer;
-	struct device *dev;
+	struct device *dev = &data->intf->dev;
+	u8 *buffer = seq->buffer;
+	bool clear = seq->type == USBTMC_RECOVERY_CLEAR;
+	u8 recipient = clear ? USB_RECIP_INTERFACE : USB_RECIP_ENDPOINT;
+	u16 index;
 	int rv;
-	int n;
-	int actual;
 
-	dev = &data->intf->dev;
-	buffer = kmalloc(USBTMC_BUFSIZE, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	if (clear)
+		index = 0;
+	else if (seq->type == USBTMC_RECOVERY_ABORT_BULK_IN)
+		index = data->bulk_in;
+	else
+		index = data->bulk_out;
 
 	rv = usb_control_msg(data->usb_dev,
 			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_INITIATE_ABORT_BULK_IN,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT,
-			     tag, data->bulk_in,
-			     buffer, 2, USB_CTRL_GET_TIMEOUT);
+			     request, USB_DIR_IN | USB_TYPE_CLASS | recipient,
+			     value, index, buffer, size, USB_CTRL_GET_TIMEOUT);
+	trace_usbtmc_ctrl_request(dev, request, value, rv, buffer);
 
 	if (rv < 0) {
 		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
+		return rv;
 	}
 
-	dev_dbg(dev, "INITIATE_ABORT_BULK_IN returned %x with tag %02x\n",
-		buffer[0], buffer[1]);
-
-	if (buffer[0] == USBTMC_STATUS_FAILED) {
-		/* No transfer in progress and the Bulk-OUT FIFO is empty. */
-		rv = 0;
-		goto exit;
-	}
+	dev_dbg(dev, "request %u returned %x\n", request, buffer[0]);
+	return 0;
+}
 
-	if (buffer[0] == USBTMC_STATUS_TRANSFER_NOT_IN_PROGRESS) {
-		/* The device returns this status if either:
-		 * - There is a transfer in progress, but the specified bTag
-		 *   does not match.
-		 * - There is no transfer in progress, but the Bulk-OUT FIFO
-		 *   is not empty.
-		 */
-		rv = -ENOMSG;
-		goto exit;
-	}
+/*
+ * Doubles the delay between two status polls of a PENDING sequence,
+ * starting with USBTMC_RECOVERY_MIN_DELAY. Fast devices are polled at a
+ * high rate and slow ones are not stressed with subsequent requests.
+ */
+static int usbtmc_recovery_poll(struct usbtmc_recovery_seq *seq)
+{
+	if (++seq->n >= USBTMC_MAX_READS_TO_CLEAR_BULK_IN)
+		return -EPERM;
 
-	if (buffer[0] != USBTMC_STATUS_SUCCESS) {
-		dev_err(dev, "INITIATE_ABORT_BULK_IN returned %x\n",
-			buffer[0]);
-		rv = -EPERM;
-		goto exit;
-	}
+	seq->delay = seq->backoff;
+	seq->backoff = min_t(unsigned int, 2 * seq->backoff,
+			     USBTMC_RECOVERY_MAX_DELAY);
+	return 0;
+}
 
-	n = 0;
+/* Reads a Bulk-IN packet to empty the device buffer */
+static int usbtmc_recovery_read(struct usbtmc_device_data *data,
+				struct usbtmc_recovery_seq *seq)
+{
+	struct device *dev = &data->intf->dev;
+	bool clear = seq->type == USBTMC_RECOVERY_CLEAR;
+	int actual = 0;
+	int rv;
 
-usbtmc_abort_bulk_in_status:
 	dev_dbg(dev, "Reading from bulk in EP\n");
 
-	actual = 0;
-
-	/* Data must be present. So use low timeout 300 ms */
+	/* Data of ABORT_BULK_IN must be present. So use low timeout 300 ms */
 	rv = usb_bulk_msg(data->usb_dev,
-			  usb_rcvbulkpipe(data->usb_dev,
-					  data->bulk_in),
-			  buffer, USBTMC_BUFSIZE,
-			  &actual, 300);
+			  usb_rcvbulkpipe(data->usb_dev, data->bulk_in),
+			  seq->buffer, USBTMC_BUFSIZE, &actual,
+			  clear ? USB_CTRL_GET_TIMEOUT : 300);
 #if VERBOSE
 	print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE, 16, 1,
-			     buffer, actual, true);
+			     seq->buffer, actual, true);
 #endif
-	n++;
+	seq->n++;
 
 	if (rv < 0) {
 		dev_err(dev, "usb_bulk_msg returned %d\n", rv);
-		if (rv != -ETIMEDOUT)
-			goto exit;
+		if (clear || rv != -ETIMEDOUT)
+			return rv;
 	}
 
-	if (actual == USBTMC_BUFSIZE)
-		goto usbtmc_abort_bulk_in_status;
-
-	if (n >= USBTMC_MAX_READS_TO_CLEAR_BULK_IN) {
+	if (seq->n >= USBTMC_MAX_READS_TO_CLEAR_BULK_IN) {
 		dev_err(dev, "Couldn't clear device buffer within %d cycles\n",
 			USBTMC_MAX_READS_TO_CLEAR_BULK_IN);
-		rv = -EPERM;
-		goto exit;
+		return -EPERM;
 	}
 
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_CHECK_ABORT_BULK_IN_STATUS,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT,
-			     0, data->bulk_in, buffer, 0x08,
-			     USB_CTRL_GET_TIMEOUT);
+	/* a short packet ends the transfer, the device data was dropped */
+	if (actual < USBTMC_BUFSIZE) {
+		seq->state = USBTMC_RECOVERY_CHECK_STATUS;
+		seq->backoff = USBTMC_RECOVERY_MIN_DELAY;
+	}
+	return 0;
+}
 
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
+static int usbtmc_recovery_initiate(struct usbtmc_device_data *data,
+				    struct usbtmc_recovery_seq *seq)
+{
+	struct device *dev = &data->intf->dev;
+	u8 *buffer = seq->buffer;
+	int rv;
+
+	switch (seq->type) {
+	case USBTMC_RECOVERY_CLEAR:
+		rv = usbtmc_recovery_ctrl(data, seq,
+					  USBTMC_REQUEST_INITIATE_CLEAR, 0, 1);
+		if (rv < 0)
+			return rv;
+		if (buffer[0] != USBTMC_STATUS_SUCCESS) {
+			dev_err(dev, "INITIATE_CLEAR returned %x\n",
+				buffer[0]);
+			return -EPERM;
+		}
+		seq->state = USBTMC_RECOVERY_CHECK_STATUS;
+		return 0;
+
+	case USBTMC_RECOVERY_ABORT_BULK_IN:
+		rv = usbtmc_recovery_ctrl(data, seq,
+					  USBTMC_REQUEST_INITIATE_ABORT_BULK_IN,
+					  seq->tag, 2);
+		if (rv < 0)
+			return rv;
+		if (buffer[0] == USBTMC_STATUS_FAILED) {
+			/* No transfer in progress and the Bulk-OUT FIFO is
+			 * empty.
+			 */
+			seq->state = USBTMC_RECOVERY_DONE;
+			return 0;
+		}
+		if (buffer[0] == USBTMC_STATUS_TRANSFER_NOT_IN_PROGRESS) {
+			/* The device returns this status if either:
+			 * - There is a transfer in progress, but the specified
+			 *   bTag does not match.
+			 * - There is no transfer in progress, but the Bulk-OUT
+			 *   FIFO is not empty.
+			 */
+			return -ENOMSG;
+		}
+		if (buffer[0] != USBTMC_STATUS_SUCCESS) {
+			dev_err(dev, "INITIATE_ABORT_BULK_IN returned %x\n",
+				buffer[0]);
+			return -EPERM;
+		}
+		seq->state = USBTMC_RECOVERY_READ_BULK_IN;
+		return 0;
+
+	case USBTMC_RECOVERY_ABORT_BULK_OUT:
+		rv = usbtmc_recovery_ctrl(data, seq,
+					  USBTMC_REQUEST_INITIATE_ABORT_BULK_OUT,
+					  seq->tag, 2);
+		if (rv < 0)
+			return rv;
+		if (buffer[0] != USBTMC_STATUS_SUCCESS) {
+			dev_err(dev, "INITIATE_ABORT_BULK_OUT returned %x\n",
+				buffer[0]);
+			return -EPERM;
+		}
+		seq->state = USBTMC_RECOVERY_CHECK_STATUS;
+		/* give the device some time to abort the transfer */
+		seq->delay = seq->backoff;
+		return 0;
 	}
 
-	dev_dbg(dev, "CHECK_ABORT_BULK_IN returned %x\n", buffer[0]);
+	return -EINVAL;
+}
+
+static int usbtmc_recovery_check_status(struct usbtmc_device_data *data,
+					struct usbtmc_recovery_seq *seq)
+{
+	static const u8 requests[] = {
+		[USBTMC_RECOVERY_CLEAR] = USBTMC_REQUEST_CHECK_CLEAR_STATUS,
+		[USBTMC_RECOVERY_ABORT_BULK_IN] =
+			USBTMC_REQUEST_CHECK_ABORT_BULK_IN_STATUS,
+		[USBTMC_RECOVERY_ABORT_BULK_OUT] =
+			USBTMC_REQUEST_CHECK_ABORT_BULK_OUT_STATUS,
+	};
+	struct device *dev = &data->intf->dev;
+	u8 *buffer = seq->buffer;
+	int rv;
+
+	rv = usbtmc_recovery_ctrl(data, seq, requests[seq->type], 0,
+				  seq->type == USBTMC_RECOVERY_CLEAR ? 2 : 8);
+	if (rv < 0)
+		return rv;
 
 	if (buffer[0] == USBTMC_STATUS_SUCCESS) {
-		rv = 0;
-		goto exit;
+		if (seq->type == USBTMC_RECOVERY_ABORT_BULK_IN)
+			seq->state = USBTMC_RECOVERY_DONE;
+		else
+			seq->state = USBTMC_RECOVERY_CLEAR_HALT;
+		return 0;
 	}
 
 	if (buffer[0] != USBTMC_STATUS_PENDING) {
-		dev_err(dev, "CHECK_ABORT_BULK_IN returned %x\n", buffer[0]);
-		rv = -EPERM;
-		goto exit;
+		dev_err(dev, "CHECK_STATUS returned %x\n", buffer[0]);
+		return -EPERM;
 	}
 
-	if ((buffer[1] & 1) > 0) {
-		/* The device has 1 or more queued packets the Host can read */
-		goto usbtmc_abort_bulk_in_status;
+	/* bmClear.D0 and bmAbortBulkIn.D0: the device has queued packets */
+	if (seq->type != USBTMC_RECOVERY_ABORT_BULK_OUT && (buffer[1] & 1)) {
+		seq->state = USBTMC_RECOVERY_READ_BULK_IN;
+		return 0;
 	}
 
-	/* The Host must send CHECK_ABORT_BULK_IN_STATUS at a later time. */
-	rv = -EAGAIN;
-exit:
-	kfree(buffer);
+	rv = usbtmc_recovery_poll(seq);
+	if (rv < 0) {
+		dev_err(dev, "Sequence still pending after %u polls\n",
+			seq->n);
+		/* The Host must send CHECK_ABORT_BULK_IN_STATUS later. */
+		if (seq->type == USBTMC_RECOVERY_ABORT_BULK_IN)
+			rv = -EAGAIN;
+	}
 	return rv;
 }
 
-static int usbtmc_ioctl_abort_bulk_in(struct usbtmc_device_data *data)
-{
-	return usbtmc_ioctl_abort_bulk_in_tag(data, data->bTag_last_read);
-}
-
-static int usbtmc_ioctl_abort_bulk_out_tag(struct usbtmc_device_data *data,
-					   u8 tag)
+/*
+ * Executes the next step of the sequence. Returns a negative error code or
+ * 0 when seq->state is the next state (USBTMC_RECOVERY_DONE at the end)
+ * that has to be executed after seq->delay ms. The caller holds
+ * abort_mutex.
+ */
+static int usbtmc_recovery_step(struct usbtmc_device_data *data,
+				struct usbtmc_recovery_seq *seq)
 {
-	struct device *dev;
-	u8 *buffer;
 	int rv;
-	int n;
-
-	dev = &data->intf->dev;
-
-	buffer = kmalloc(8, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
 
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_INITIATE_ABORT_BULK_OUT,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT,
-			     tag, data->bulk_out,
-			     buffer, 2, USB_CTRL_GET_TIMEOUT);
+	seq->delay = 0;
 
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
-	}
+	switch (seq->state) {
+	case USBTMC_RECOVERY_INITIATE:
+		/* the device discards the pending message */
+		atomic_set(&data->response_pending, 0);
+		return usbtmc_recovery_initiate(data, seq);
 
-	dev_dbg(dev, "INITIATE_ABORT_BULK_OUT returned %x\n", buffer[0]);
+	case USBTMC_RECOVERY_CHECK_STATUS:
+		return usbtmc_recovery_check_status(data, seq);
 
-	if (buffer[0] != USBTMC_STATUS_SUCCESS) {
-		dev_err(dev, "INITIATE_ABORT_BULK_OUT returned %x\n",
-			buffer[0]);
-		rv = -EPERM;
-		goto exit;
-	}
+	case USBTMC_RECOVERY_READ_BULK_IN:
+		return usbtmc_recovery_read(data, seq);
 
-	n = 0;
+	case USBTMC_RECOVERY_CLEAR_HALT:
+		rv = usb_clear_halt(data->usb_dev,
+				    usb_sndbulkpipe(data->usb_dev,
+						    data->bulk_out));
+		if (rv < 0) {
+			dev_err(&data->intf->dev,
+				"usb_clear_halt returned %d\n", rv);
+			return rv;
+		}
+		seq->state = USBTMC_RECOVERY_DONE;
+		return 0;
 
-usbtmc_abort_bulk_out_check_status:
-	/* do not stress device with subsequent requests */
-	msleep(50);
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_CHECK_ABORT_BULK_OUT_STATUS,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT,
-			     0, data->bulk_out, buffer, 0x08,
-			     USB_CTRL_GET_TIMEOUT);
-	n++;
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
+	case USBTMC_RECOVERY_DONE:
+		break;
 	}
 
-	dev_dbg(dev, "CHECK_ABORT_BULK_OUT returned %x\n", buffer[0]);
+	return 0;
+}
 
-	if (buffer[0] == USBTMC_STATUS_SUCCESS)
-		goto usbtmc_abort_bulk_out_clear_halt;
+static void usbtmc_recovery_init(struct usbtmc_recovery_seq *seq,
+				 u8 type, u8 tag)
+{
+	seq->type = type;
+	seq->tag = tag;
+	seq->state = USBTMC_RECOVERY_INITIATE;
+	seq->n = 0;
+	seq->delay = 0;
+	seq->backoff = USBTMC_RECOVERY_MIN_DELAY;
+}
 
-	if ((buffer[0] == USBTMC_STATUS_PENDING) &&
-	    (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN))
-		goto usbtmc_abort_bulk_out_check_status;
+/*
+ * Runs a sequence synchronously. The caller holds abort_mutex.
+ * Returns -EBUSY while a sequence of USBTMC_IOCTL_RECOVERY_START is
+ * running.
+ */
+static int usbtmc_recovery_run(struct usbtmc_device_data *data,
+			       u8 type, u8 tag)
+{
+	struct usbtmc_recovery_seq seq;
+	int rv;
 
-	rv = -EPERM;
-	goto exit;
+	if (READ_ONCE(data->recovery.result) == -EINPROGRESS)
+		return -EBUSY;
 
-usbtmc_abort_bulk_out_clear_halt:
-	rv = usb_clear_halt(data->usb_dev,
-			    usb_sndbulkpipe(data->usb_dev, data->bulk_out));
+	seq.buffer = kmalloc(USBTMC_BUFSIZE, GFP_KERNEL);
+	if (!seq.buffer)
+		return -ENOMEM;
 
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
-	}
-	rv = 0;
+	usbtmc_recovery_init(&seq, type, tag);
+	do {
+		if (seq.delay)
+			msleep(seq.delay);
+		rv = usbtmc_recovery_step(data, &seq);
+	} while (rv == 0 && seq.state != USBTMC_RECOVERY_DONE);
 
-exit:
-	kfree(buffer);
+	kfree(seq.buffer);
 	return rv;
 }
 
-static int usbtmc_ioctl_abort_bulk_out(struct usbtmc_device_data *data)
+static int usbtmc_ioctl_abort_bulk_in_tag(struct usbtmc_device_data *data,
+					  u8 tag)
 {
-	return usbtmc_ioctl_abort_bulk_out_tag(data, data->bTag_last_write);
+	return usbtmc_recovery_run(data, USBTMC_RECOVERY_ABORT_BULK_IN, tag);
 }
 
-static int usbtmc488_ioctl_read_stb(struct usbtmc_file_data *file_data,
-				void __user *arg)
+static int usbtmc_ioctl_abort_bulk_in(struct usbtmc_device_data *data)
+{
+	return usbtmc_ioctl_abort_bulk_in_tag(data, data->bTag_last_read);
+}
+
+static int usbtmc_ioctl_abort_bulk_out_tag(struct usbtmc_device_data *data,
+					   u8 tag)
+{
+	return usbtmc_recovery_run(data, USBTMC_RECOVERY_ABORT_BULK_OUT, tag);
+}
+
+static int usbtmc_ioctl_abort_bulk_out(struct usbtmc_device_data *data)
+{
+	return usbtmc_ioctl_abort_bulk_out_tag(data, data->bTag_last_write);
+}
+
+static int usbtmc_ioctl_clear(struct usbtmc_device_data *data)
+{
+	dev_dbg(&data->intf->dev, "Sending INITIATE_CLEAR request\n");
+
+	return usbtmc_recovery_run(data, USBTMC_RECOVERY_CLEAR, 0);
+}
+
+/* Ends the sequence of USBTMC_IOCTL_RECOVERY_START with result rv */
+static void usbtmc_recovery_end(struct usbtmc_device_data *data,
+				struct usbtmc_recovery_seq *seq, int rv)
+{
+	dev_dbg(&data->intf->dev, "%s: sequence %u returned %d\n",
+		__func__, seq->type, rv);
+	kfree(seq->buffer);
+	seq->buffer = NULL;
+	WRITE_ONCE(seq->result, rv);
+	wake_up_interruptible_all(&seq->wait);
+	kref_put(&data->kref, usbtmc_delete);
+}
+
+/*
+ * Work item of USBTMC_IOCTL_RECOVERY_START. abort_mutex is only held
+ * during a single step, so other file handles are not blocked while the
+ * device is polled. The work holds a reference to the device data.
+ */
+static void usbtmc_recovery_work(struct work_struct *work)
+{
+	struct usbtmc_recovery_seq *seq =
+		container_of(to_delayed_work(work),
+			     struct usbtmc_recovery_seq, work);
+	struct usbtmc_device_data *data =
+		container_of(seq, struct usbtmc_device_data, recovery);
+	int rv;
+
+	usbtmc_mutex_lock(data, &data->abort_mutex);
+	if (data->zombie)
+		rv = -ENODEV;
+	else
+		rv = usbtmc_recovery_step(data, seq);
+	mutex_unlock(&data->abort_mutex);
+
+	if (rv == 0 && seq->state != USBTMC_RECOVERY_DONE) {
+		queue_delayed_work(system_long_wq, &seq->work,
+				   msecs_to_jiffies(seq->delay));
+		return;
+	}
+	usbtmc_recovery_end(data, seq, rv);
+}
+
+/*
+ * Starts a CLEAR or ABORT sequence in the background. The result is
+ * returned by USBTMC_IOCTL_RECOVERY_RESULT. Only one sequence per device
+ * can run at a time.
+ */
+static int usbtmc_ioctl_recovery_start(struct usbtmc_file_data *file_data,
+				       void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_recovery_seq *seq = &data->recovery;
+	struct usbtmc_recovery recovery;
+	u8 tag;
+
+	if (copy_from_user(&recovery, arg, sizeof(recovery)))
+		return -EFAULT;
+
+	switch (recovery.type) {
+	case USBTMC_RECOVERY_CLEAR:
+		tag = 0;
+		break;
+	case USBTMC_RECOVERY_ABORT_BULK_IN:
+		tag = data->bTag_last_read;
+		break;
+	case USBTMC_RECOVERY_ABORT_BULK_OUT:
+		tag = data->bTag_last_write;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (recovery.flags & ~USBTMC_RECOVERY_TAG)
+		return -EINVAL;
+	if (recovery.flags & USBTMC_RECOVERY_TAG)
+		tag = recovery.tag;
+
+	if (READ_ONCE(seq->result) == -EINPROGRESS)
+		return -EBUSY;
+
+	seq->buffer = kmalloc(USBTMC_BUFSIZE, GFP_KERNEL);
+	if (!seq->buffer)
+		return -ENOMEM;
+
+	if (recovery.type == USBTMC_RECOVERY_CLEAR)
+		usbtmc_count(file_data, USBTMC_STAT_CLEARS, 1);
+	else
+		usbtmc_count(file_data, USBTMC_STAT_ABORTS, 1);
+
+	usbtmc_recovery_init(seq, recovery.type, tag);
+	WRITE_ONCE(seq->result, -EINPROGRESS);
+	kref_get(&data->kref);
+	queue_delayed_work(system_long_wq, &seq->work, 0);
+	return 0;
+}
+
+/*
+ * Returns the state of the last sequence started with
+ * USBTMC_IOCTL_RECOVERY_START. Waits up to recovery.timeout ms for the
+ * end of a running sequence. recovery.status is -EINPROGRESS while the
+ * sequence is running.
+ */
+static int usbtmc_ioctl_recovery_result(struct usbtmc_file_data *file_data,
+					void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_recovery_seq *seq = &data->recovery;
+	struct usbtmc_recovery recovery;
+	long rv;
+
+	if (copy_from_user(&recovery, arg, sizeof(recovery)))
+		return -EFAULT;
+
+	if (recovery.timeout) {
+		rv = wait_event_interruptible_timeout(
+			seq->wait,
+			READ_ONCE(seq->result) != -EINPROGRESS,
+			msecs_to_jiffies(recovery.timeout));
+		if (rv < 0)
+			return rv;
+	}
+
+	recovery.type = seq->type;
+	recovery.flags = USBTMC_RECOVERY_TAG;
+	recovery.tag = seq->tag;
+	recovery.status = READ_ONCE(seq->result);
+
+	if (copy_to_user(arg, &recovery, sizeof(recovery)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Aborts the last Bulk-IN transfer after an error if auto_abort is enabled.
+ * The caller holds in_mutex.
+ */
+static void usbtmc_auto_abort_bulk_in(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_device_data *data = file_data->data;
+
+	if (!file_data->auto_abort)
+		return;
+
+	usbtmc_count(file_data, USBTMC_STAT_ABORTS, 1);
+	usbtmc_mutex_lock(data, &data->abort_mutex);
+	usbtmc_ioctl_abort_bulk_in(data);
+	mutex_unlock(&data->abort_mutex);
+}
+
+/*
+ * Aborts the last Bulk-OUT transfer after an error if auto_abort is
+ * enabled. The caller holds out_mutex.
+ */
+static void usbtmc_auto_abort_bulk_out(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_device_data *data = file_data->data;
+
+	if (!file_data->auto_abort)
+		return;
+
+	usbtmc_count(file_data, USBTMC_STAT_ABORTS, 1);
+	usbtmc_mutex_lock(data, &data->abort_mutex);
+	usbtmc_ioctl_abort_bulk_out(data);
+	mutex_unlock(&data->abort_mutex);
+}
+
+static int usbtmc488_ioctl_read_stb(struct usbtmc_file_data *file_data,
+				void __user *arg)
 {
 	struct usbtmc_device_data *data = file_data->data;
 	struct device *dev = &data->intf->dev;
-	int srq_asserted = 0;
+	struct usbtmc_srq_event event;
 	u8 *buffer;
 	u8 tag;
 	__u8 stb;
@@ -512,11 +1235,12 @@ static int usbtmc488_ioctl_read_stb(struct usbtmc_file_data *file_data,
 		data->iin_ep_present);
 
 	spin_lock_irq(&data->dev_lock);
-	srq_asserted = atomic_xchg(&file_data->srq_asserted, srq_asserted);
-	if (srq_asserted) {
-		/* a STB with SRQ is already received */
-		stb = file_data->srq_byte;
+	if (kfifo_get(&file_data->srq_fifo, &event)) {
+		/* a STB with SRQ is already received: return the oldest */
+		atomic_set(&file_data->srq_asserted,
+			   !kfifo_is_empty(&file_data->srq_fifo));
 		spin_unlock_irq(&data->dev_lock);
+		stb = event.stb;
 		rv = put_user(stb, (__u8 __user *)arg);
 		dev_dbg(dev, "stb:0x%02x with srq received %d\n",
 			(unsigned int)stb, rv);
@@ -528,6 +1252,14 @@ static int usbtmc488_ioctl_read_stb(struct usbtmc_file_data *file_data,
 	if (!buffer)
 		return -ENOMEM;
 
+	/* only serialized with other short control requests */
+	usbtmc_mutex_lock(data, &data->ctrl_mutex);
+	if (data->zombie) {
+		mutex_unlock(&data->ctrl_mutex);
+		kfree(buffer);
+		return -ENODEV;
+	}
+
 	atomic_set(&data->iin_data_valid, 0);
 
 	rv = usb_control_msg(data->usb_dev,
@@ -584,11 +1316,45 @@ static int usbtmc488_ioctl_read_stb(struct usbtmc_file_data *file_data,
 	if (data->iin_bTag > 127)
 		/* 1 is for SRQ see USBTMC-USB488 subclass spec section 4.3.1 */
 		data->iin_bTag = 2;
+	mutex_unlock(&data->ctrl_mutex);
 
 	kfree(buffer);
 	return rv;
 }
 
+/*
+ * Returns up to events.count queued SRQ events, oldest first, and the
+ * number of events lost since the last call.
+ */
+static int usbtmc488_ioctl_read_srq_events(struct usbtmc_file_data *file_data,
+					   void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_srq_event buffer[USBTMC_SRQ_EVENTS];
+	struct usbtmc_srq_events events;
+	u32 n = 0;
+
+	if (copy_from_user(&events, arg, sizeof(events)))
+		return -EFAULT;
+
+	spin_lock_irq(&data->dev_lock);
+	while (n < min_t(u32, events.count, USBTMC_SRQ_EVENTS) &&
+	       kfifo_get(&file_data->srq_fifo, &buffer[n]))
+		n++;
+	atomic_set(&file_data->srq_asserted,
+		   !kfifo_is_empty(&file_data->srq_fifo));
+	events.lost = file_data->srq_lost;
+	file_data->srq_lost = 0;
+	spin_unlock_irq(&data->dev_lock);
+
+	events.count = n;
+	if (copy_to_user(events.events, buffer, n * sizeof(buffer[0])) ||
+	    copy_to_user(arg, &events, sizeof(events)))
+		return -EFAULT;
+
+	return 0;
+}
+
 static int usbtmc488_ioctl_wait_srq(struct usbtmc_file_data *file_data,
 				    __u32 __user *arg)
 {
@@ -611,9 +1377,10 @@ static int usbtmc488_ioctl_wait_srq(struct usbtmc_file_data *file_data,
 	mutex_unlock(&data->io_mutex);
 
 	rv = wait_event_interruptible_timeout(
-			data->waitq,
+			file_data->waitq,
 			atomic_read(&file_data->srq_asserted) != 0 ||
-			atomic_read(&file_data->closing),
+			atomic_read(&file_data->closing) ||
+			READ_ONCE(data->zombie),
 			expire);
 
 	mutex_lock(&data->io_mutex);
@@ -703,7 +1470,7 @@ static int usbtmc488_ioctl_trigger(struct usbtmc_file_data *file_data)
 	struct usbtmc_device_data *data = file_data->data;
 	int retval;
 	u8 *buffer;
-	int actual;
+	int actual = 0;
 
 	buffer = kzalloc(USBTMC_HEADER_SIZE, GFP_KERNEL);
 	if (!buffer)
@@ -712,12 +1479,14 @@ static int usbtmc488_ioctl_trigger(struct usbtmc_file_data *file_data)
 	buffer[0] = 128;
 	buffer[1] = data->bTag;
 	buffer[2] = ~data->bTag;
+	trace_usbtmc_header_send(&data->intf->dev, file_data, buffer);
 
 	retval = usb_bulk_msg(data->usb_dev,
 			      usb_sndbulkpipe(data->usb_dev,
 					      data->bulk_out),
 			      buffer, USBTMC_HEADER_SIZE,
 			      &actual, file_data->timeout);
+	usbtmc_count(file_data, USBTMC_STAT_BYTES_OUT, actual);
 
 	/* Store bTag (in case we need to abort) */
 	data->bTag_last_write = data->bTag;
@@ -737,16 +1506,18 @@ static int usbtmc488_ioctl_trigger(struct usbtmc_file_data *file_data)
 	return 0;
 }
 
-static struct urb *usbtmc_create_urb(void)
+static struct urb *usbtmc_create_urb(struct usbtmc_file_data *file_data)
 {
-	const size_t bufsize = USBTMC_BUFSIZE;
+	struct usb_device *usb_dev = file_data->data->usb_dev;
+	const u32 bufsize = file_data->bufsize;
 	u8 *dmabuf = NULL;
 	struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
 
 	if (!urb)
 		return NULL;
 
-	dmabuf = kmalloc(bufsize, GFP_KERNEL);
+	dmabuf = usb_alloc_coherent(usb_dev, bufsize, GFP_KERNEL,
+				    &urb->transfer_dma);
 	if (!dmabuf) {
 		usb_free_urb(urb);
 		return NULL;
@@ -754,16 +1525,175 @@ static struct urb *usbtmc_create_urb(void)
 
 	urb->transfer_buffer = dmabuf;
 	urb->transfer_buffer_length = bufsize;
-	urb->transfer_flags |= URB_FREE_BUFFER;
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	return urb;
+}
+
+/*
+ * Takes an urb from the pool of the file handle. The pool grows on demand
+ * up to the number of urbs in use at the same time, which is limited by
+ * MAX_URBS_IN_FLIGHT for reads and by limit_write_sem for writes.
+ * The caller owns the returned reference.
+ */
+static struct urb *usbtmc_get_urb(struct usbtmc_file_data *file_data)
+{
+	struct urb *urb;
+
+	/*
+	 * in_mutex or out_mutex locked. The anchor serializes concurrent
+	 * readers and writers of the file handle.
+	 */
+
+	urb = usb_get_from_anchor(&file_data->urb_pool);
+	/* the number of ring buffers is fixed */
+	if (urb || file_data->ring_buffer)
+		return urb;
+
+	urb = usbtmc_create_urb(file_data);
+	if (urb)
+		atomic_inc(&file_data->pool_size);
+
+	return urb;
+}
+
+/*
+ * Takes an urb for a Bulk-OUT transfer. The ring buffers are reserved for
+ * Bulk-IN data, so writers get urbs of their own while a ring is
+ * allocated. Their number is limited by limit_write_sem.
+ */
+static struct urb *usbtmc_get_out_urb(struct usbtmc_file_data *file_data)
+{
+	struct urb *urb;
+
+	if (!file_data->ring_buffer)
+		return usbtmc_get_urb(file_data);
+
+	urb = usb_get_from_anchor(&file_data->out_pool);
+	if (!urb)
+		urb = usbtmc_create_urb(file_data);
 	return urb;
 }
 
+/* Returns the pool an urb belongs to, see usbtmc_get_out_urb */
+static struct usb_anchor *usbtmc_pool_of(struct usbtmc_file_data *file_data,
+					 struct urb *urb)
+{
+	u8 *buffer = urb->transfer_buffer;
+
+	if (file_data->ring_buffer &&
+	    (buffer < file_data->ring_buffer ||
+	     buffer >= file_data->ring_buffer +
+		       file_data->ring_size * file_data->bufsize))
+		return &file_data->out_pool;
+	return &file_data->urb_pool;
+}
+
+/*
+ * Returns an urb to the pool and releases the reference of the caller.
+ */
+static void usbtmc_put_urb(struct usbtmc_file_data *file_data,
+			   struct urb *urb)
+{
+	usb_anchor_urb(urb, usbtmc_pool_of(file_data, urb));
+	usb_free_urb(urb);
+}
+
+/*
+ * Returns all urbs of the given anchor to the pool, e.g. received urbs
+ * which are not needed any more.
+ */
+static void usbtmc_recycle_anchored_urbs(struct usbtmc_file_data *file_data,
+					 struct usb_anchor *anchor)
+{
+	struct urb *urb;
+
+	while ((urb = usb_get_from_anchor(anchor)) != NULL)
+		usbtmc_put_urb(file_data, urb);
+}
+
+/*
+ * Frees all urbs of the pool including the ring buffers.
+ * No urb must be submitted.
+ */
+static void usbtmc_free_pool(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct urb *urb;
+	u32 i;
+
+	for (i = 0; i < file_data->ring_size; i++) {
+		if (test_and_clear_bit(i, file_data->ring_loaned))
+			usbtmc_put_urb(file_data, file_data->ring_urbs[i]);
+	}
+
+	while ((urb = usb_get_from_anchor(&file_data->out_pool)) != NULL) {
+		usb_free_coherent(data->usb_dev, file_data->bufsize,
+				  urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+	}
+
+	while ((urb = usb_get_from_anchor(&file_data->urb_pool)) != NULL) {
+		if (!file_data->ring_buffer)
+			usb_free_coherent(data->usb_dev, file_data->bufsize,
+					  urb->transfer_buffer,
+					  urb->transfer_dma);
+		usb_free_urb(urb);
+		atomic_dec(&file_data->pool_size);
+	}
+
+	if (atomic_read(&file_data->pool_size)) {
+		/* do not free dma memory which is still in use */
+		dev_warn(&data->intf->dev, "%d urbs not returned to pool\n",
+			 atomic_read(&file_data->pool_size));
+	} else if (file_data->ring_buffer) {
+		usb_free_coherent(data->usb_dev,
+				  PAGE_ALIGN(file_data->ring_size *
+					     file_data->bufsize),
+				  file_data->ring_buffer, file_data->ring_dma);
+	}
+
+	kfree(file_data->ring_urbs);
+	file_data->ring_urbs = NULL;
+	file_data->ring_buffer = NULL;
+	file_data->ring_size = 0;
+	atomic_set(&file_data->pool_size, 0);
+}
+
+/*
+ * Signals the eventfd registered for event with USBTMC_IOCTL_SET_EVENTFD.
+ * The caller holds err_lock.
+ */
+static void usbtmc_signal_event(struct usbtmc_file_data *file_data,
+				unsigned int event)
+{
+	if (file_data->eventfd[event])
+		eventfd_signal(file_data->eventfd[event]);
+}
+
+/*
+ * Wakes up the poll waiters of the file handle after a bulk transfer
+ * completed. key holds the new poll events. EPOLLOUT is added when all
+ * bulk urbs are done.
+ */
+static void usbtmc_wake_up_poll(struct usbtmc_file_data *file_data,
+				__poll_t key)
+{
+	if (usb_anchor_empty(&file_data->submitted) &&
+	    usb_anchor_empty(&file_data->in_submitted))
+		key |= EPOLLOUT | EPOLLWRNORM;
+	if (key)
+		wake_up_interruptible_poll(&file_data->waitq, key);
+}
+
 static void usbtmc_read_bulk_cb(struct urb *urb)
 {
 	struct usbtmc_file_data *file_data = urb->context;
+	ktime_t now = ktime_get();
 	int status = urb->status;
 	unsigned long flags;
 
+	usbtmc_urb_completed(file_data, urb);
+
 	/* sync/async unlink faults aren't errors */
 	if (status) {
 		if (!(/* status == -ENOENT || */
@@ -780,17 +1710,24 @@ static void usbtmc_read_bulk_cb(struct urb *urb)
 		spin_unlock_irqrestore(&file_data->err_lock, flags);
 	}
 
+	/* keep received data until it is read by usbtmc_generic_read */
+	usb_anchor_urb(urb, &file_data->in_anchor);
+
 	spin_lock_irqsave(&file_data->err_lock, flags);
 	file_data->in_transfer_size += urb->actual_length;
+	if (!file_data->in_first_time)
+		file_data->in_first_time = now;
+	file_data->in_last_time = now;
 	dev_dbg(&file_data->data->intf->dev,
 		"%s - total size: %u current: %d status: %d\n",
 		__func__, file_data->in_transfer_size,
 		urb->actual_length, status);
+	usbtmc_signal_event(file_data, USBTMC_EVENT_IN_READY);
 	spin_unlock_irqrestore(&file_data->err_lock, flags);
-	usb_anchor_urb(urb, &file_data->in_anchor);
 
 	wake_up_interruptible(&file_data->wait_bulk_in);
-	wake_up_interruptible(&file_data->data->waitq);
+	usbtmc_wake_up_poll(file_data, EPOLLIN | EPOLLRDNORM |
+			    (status ? EPOLLERR : 0));
 }
 
 static inline bool usbtmc_do_transfer(struct usbtmc_file_data *file_data)
@@ -806,20 +1743,110 @@ static inline bool usbtmc_do_transfer(struct usbtmc_file_data *file_data)
 	return data_or_error;
 }
 
+/*
+ * Returns the deadline of a new transfer. If a deadline is set with
+ * USBTMC_IOCTL_SET_DEADLINE or the flag USBTMC_FLAG_DEADLINE is given, all
+ * waits of the transfer end at the returned time. Otherwise KTIME_MAX is
+ * returned and the timeout of the file handle applies to each wait.
+ */
+static ktime_t usbtmc_deadline(struct usbtmc_file_data *file_data, u32 flags)
+{
+	if (file_data->deadline_ns)
+		return ktime_add_ns(ktime_get(), file_data->deadline_ns);
+	if (flags & USBTMC_FLAG_DEADLINE)
+		return ktime_add_ms(ktime_get(), file_data->timeout);
+	return KTIME_MAX;
+}
+
+/*
+ * Returns the timeout of a synchronous transfer in ms, see usb_bulk_msg(),
+ * or -ETIMEDOUT if the deadline has expired.
+ */
+static int usbtmc_timeout_ms(struct usbtmc_file_data *file_data,
+			     ktime_t deadline)
+{
+	s64 ns;
+
+	if (deadline == KTIME_MAX)
+		return file_data->timeout;
+
+	ns = ktime_to_ns(ktime_sub(deadline, ktime_get()));
+	if (ns <= 0)
+		return -ETIMEDOUT;
+	return min_t(u64, DIV_ROUND_UP_ULL(ns, NSEC_PER_MSEC), INT_MAX);
+}
+
+/* Returns the timeout in jiffies for down_timeout(), 0 if expired */
+static long usbtmc_timeout_jiffies(struct usbtmc_file_data *file_data,
+				   ktime_t deadline)
+{
+	s64 ns;
+
+	if (deadline == KTIME_MAX)
+		return msecs_to_jiffies(file_data->timeout);
+
+	ns = ktime_to_ns(ktime_sub(deadline, ktime_get()));
+	if (ns <= 0)
+		return 0;
+	/* round up, the semaphore only waits for the completion of urbs */
+	return nsecs_to_jiffies(ns) + 1;
+}
+
+/*
+ * Waits for received Bulk-IN data or an error with hrtimer precision.
+ * Returns 0, -ETIMEDOUT or -ERESTARTSYS.
+ */
+static int usbtmc_wait_bulk_in(struct usbtmc_file_data *file_data,
+			       ktime_t deadline)
+{
+	long rv;
+
+	if (deadline == KTIME_MAX) {
+		rv = wait_event_interruptible_timeout(
+			file_data->wait_bulk_in,
+			usbtmc_do_transfer(file_data),
+			msecs_to_jiffies(file_data->timeout));
+		if (rv == 0)
+			return -ETIMEDOUT;
+		return rv < 0 ? rv : 0;
+	}
+
+	rv = wait_event_interruptible_hrtimeout(file_data->wait_bulk_in,
+						usbtmc_do_transfer(file_data),
+						ktime_sub(deadline, ktime_get()));
+	return rv == -ETIME ? -ETIMEDOUT : rv;
+}
+
+/*
+ * Waits until all urbs of the anchor are completed. Returns false on
+ * timeout like usb_wait_anchor_empty_timeout().
+ */
+static bool usbtmc_wait_anchor_empty(struct usbtmc_file_data *file_data,
+				     struct usb_anchor *anchor,
+				     ktime_t deadline)
+{
+	if (deadline == KTIME_MAX)
+		return usb_wait_anchor_empty_timeout(anchor,
+						     file_data->timeout);
+
+	return !wait_event_hrtimeout(anchor->wait, usb_anchor_empty(anchor),
+				     ktime_sub(deadline, ktime_get()));
+}
+
 static ssize_t usbtmc_generic_read(struct usbtmc_file_data *file_data,
-				   void __user *user_buffer,
+				   struct iov_iter *iter,
 				   u32 transfer_size,
 				   u32 *transferred,
-				   u32 flags)
+				   u32 flags,
+				   ktime_t deadline)
 {
 	struct usbtmc_device_data *data = file_data->data;
 	struct device *dev = &data->intf->dev;
 	u32 done = 0;
 	u32 remaining;
-	const u32 bufsize = USBTMC_BUFSIZE;
+	const u32 bufsize = file_data->bufsize;
 	int retval = 0;
 	u32 max_transfer_size;
-	unsigned long expire;
 	int bufcount = 1;
 	int again = 0;
 
@@ -827,6 +1854,9 @@ static ssize_t usbtmc_generic_read(struct usbtmc_file_data *file_data,
 
 	*transferred = done;
 
+	if (file_data->streaming)
+		return -EBUSY;
+
 	max_transfer_size = transfer_size;
 
 	if (flags & USBTMC_FLAG_IGNORE_TRAILER) {
@@ -891,9 +1921,12 @@ static ssize_t usbtmc_generic_read(struct usbtmc_file_data *file_data,
 
 	while (bufcount > 0) {
 		u8 *dmabuf = NULL;
-		struct urb *urb = usbtmc_create_urb();
+		struct urb *urb = usbtmc_get_urb(file_data);
 
 		if (!urb) {
+			/* all ring buffers in use: resubmit them later */
+			if (file_data->ring_buffer && file_data->in_urbs_used)
+				break;
 			retval = -ENOMEM;
 			goto error;
 		}
@@ -905,14 +1938,16 @@ static ssize_t usbtmc_generic_read(struct usbtmc_file_data *file_data,
 			dmabuf, bufsize,
 			usbtmc_read_bulk_cb, file_data);
 
-		usb_anchor_urb(urb, &file_data->submitted);
+		usb_anchor_urb(urb, &file_data->in_submitted);
 		retval = usb_submit_urb(urb, GFP_KERNEL);
-		/* urb is anchored. We can release our reference. */
-		usb_free_urb(urb);
 		if (unlikely(retval)) {
 			usb_unanchor_urb(urb);
+			usbtmc_put_urb(file_data, urb);
 			goto error;
 		}
+		usbtmc_urb_submitted(file_data, urb);
+		/* urb is anchored. We can release our reference. */
+		usb_free_urb(urb);
 		file_data->in_urbs_used++;
 		bufcount--;
 	}
@@ -922,31 +1957,22 @@ static ssize_t usbtmc_generic_read(struct usbtmc_file_data *file_data,
 		return -EAGAIN;
 	}
 
-	if (user_buffer == NULL)
+	if (iter == NULL)
 		return -EINVAL;
 
-	expire = msecs_to_jiffies(file_data->timeout);
-
 	while (max_transfer_size > 0) {
 		u32 this_part;
 		struct urb *urb = NULL;
 
 		if (!(flags & USBTMC_FLAG_ASYNC)) {
-			dev_dbg(dev, "%s: before wait time %lu\n",
-				__func__, expire);
-			retval = wait_event_interruptible_timeout(
-				file_data->wait_bulk_in,
-				usbtmc_do_transfer(file_data),
-				expire);
+			dev_dbg(dev, "%s: before wait\n", __func__);
+			retval = usbtmc_wait_bulk_in(file_data, deadline);
 
 			dev_dbg(dev, "%s: wait returned %d\n",
 				__func__, retval);
 
-			if (retval <= 0) {
-				if (retval == 0)
-					retval = -ETIMEDOUT;
+			if (retval < 0)
 				goto error;
-			}
 		}
 
 		urb = usb_get_from_anchor(&file_data->in_anchor);
@@ -979,9 +2005,9 @@ static ssize_t usbtmc_generic_read(struct usbtmc_file_data *file_data,
 		print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE, 16, 1,
 			urb->transfer_buffer, urb->actual_length, true);
 #endif
-		if (copy_to_user(user_buffer + done,
-				 urb->transfer_buffer, this_part)) {
-			usb_free_urb(urb);
+		if (copy_to_iter(urb->transfer_buffer, this_part,
+				 iter) != this_part) {
+			usbtmc_put_urb(file_data, urb);
 			retval = -EFAULT;
 			goto error;
 		}
@@ -994,14 +2020,15 @@ static ssize_t usbtmc_generic_read(struct usbtmc_file_data *file_data,
 			/* return the very first error */
 			retval = file_data->in_status;
 			spin_unlock_irq(&file_data->err_lock);
-			usb_free_urb(urb);
+			usbtmc_put_urb(file_data, urb);
 			goto error;
 		}
 		spin_unlock_irq(&file_data->err_lock);
 
 		if (urb->actual_length < bufsize) {
 			/* short packet or ZLP received => ready */
-			usb_free_urb(urb);
+			usbtmc_put_urb(file_data, urb);
+			usbtmc_msg_in_done(data);
 			retval = 1;
 			break;
 		}
@@ -1009,16 +2036,19 @@ static ssize_t usbtmc_generic_read(struct usbtmc_file_data *file_data,
 		if (!(flags & USBTMC_FLAG_ASYNC) &&
 		    max_transfer_size > (bufsize * file_data->in_urbs_used)) {
 			/* resubmit, since other buffers still not enough */
-			usb_anchor_urb(urb, &file_data->submitted);
+			usb_anchor_urb(urb, &file_data->in_submitted);
 			retval = usb_submit_urb(urb, GFP_KERNEL);
 			if (unlikely(retval)) {
 				usb_unanchor_urb(urb);
-				usb_free_urb(urb);
+				usbtmc_put_urb(file_data, urb);
 				goto error;
 			}
+			usbtmc_urb_submitted(file_data, urb);
+			usb_free_urb(urb);
 			file_data->in_urbs_used++;
+		} else {
+			usbtmc_put_urb(file_data, urb);
 		}
-		usb_free_urb(urb);
 		retval = 0;
 	}
 
@@ -1027,9 +2057,9 @@ error:
 
 	dev_dbg(dev, "%s: before kill\n", __func__);
 	/* Attention: killing urbs can take long time (2 ms) */
-	usb_kill_anchored_urbs(&file_data->submitted);
+	usb_kill_anchored_urbs(&file_data->in_submitted);
 	dev_dbg(dev, "%s: after kill\n", __func__);
-	usb_scuttle_anchored_urbs(&file_data->in_anchor);
+	usbtmc_recycle_anchored_urbs(file_data, &file_data->in_anchor);
 	file_data->in_urbs_used = 0;
 	file_data->in_status = 0; /* no spinlock needed here */
 	dev_dbg(dev, "%s: done=%u ret=%d\n", __func__, done, retval);
@@ -1037,718 +2067,3022 @@ error:
 	return retval;
 }
 
-static ssize_t usbtmc_ioctl_generic_read(struct usbtmc_file_data *file_data,
-					 void __user *arg)
+static void usbtmc_reset_in_time(struct usbtmc_file_data *file_data)
 {
-	struct usbtmc_message msg;
-	ssize_t retval = 0;
-
-	/* mutex already locked */
+	spin_lock_irq(&file_data->err_lock);
+	file_data->in_first_time = 0;
+	file_data->in_last_time = 0;
+	spin_unlock_irq(&file_data->err_lock);
+}
 
-	if (copy_from_user(&msg, arg, sizeof(struct usbtmc_message)))
-		return -EFAULT;
+/*
+ * Returns the time stamps of the first and last Bulk-IN transfer of the
+ * last read, see struct usbtmc_msg_in_time.
+ */
+static int usbtmc_ioctl_msg_in_time(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	struct usbtmc_msg_in_time time;
 
-	retval = usbtmc_generic_read(file_data, msg.message,
-				     msg.transfer_size, &msg.transferred,
-				     msg.flags);
+	spin_lock_irq(&file_data->err_lock);
+	time.first = ktime_to_ns(file_data->in_first_time);
+	time.last = ktime_to_ns(file_data->in_last_time);
+	spin_unlock_irq(&file_data->err_lock);
 
-	if (put_user(msg.transferred,
-		     &((struct usbtmc_message __user *)arg)->transferred))
+	if (copy_to_user(arg, &time, sizeof(time)))
 		return -EFAULT;
 
-	return retval;
+	return 0;
 }
 
-static void usbtmc_write_bulk_cb(struct urb *urb)
+/*
+ * Returns the performance counters of the file handle, see
+ * struct usbtmc_stats.
+ */
+static int usbtmc_ioctl_get_stats(struct usbtmc_file_data *file_data,
+				  void __user *arg)
 {
-	struct usbtmc_file_data *file_data = urb->context;
-	int wakeup = 0;
-	unsigned long flags;
+	atomic64_t *value = file_data->counters.value;
+	struct usbtmc_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.bytes_in = atomic64_read(&value[USBTMC_STAT_BYTES_IN]);
+	stats.bytes_out = atomic64_read(&value[USBTMC_STAT_BYTES_OUT]);
+	stats.urbs_submitted =
+		atomic64_read(&value[USBTMC_STAT_URBS_SUBMITTED]);
+	stats.urbs_completed =
+		atomic64_read(&value[USBTMC_STAT_URBS_COMPLETED]);
+	stats.short_packets = atomic64_read(&value[USBTMC_STAT_SHORT_PACKETS]);
+	stats.timeouts = atomic64_read(&value[USBTMC_STAT_TIMEOUTS]);
+	stats.aborts = atomic64_read(&value[USBTMC_STAT_ABORTS]);
+	stats.srqs = atomic64_read(&value[USBTMC_STAT_SRQS]);
+	stats.clears = atomic64_read(&value[USBTMC_STAT_CLEARS]);
+	stats.max_urbs_in_flight =
+		atomic64_read(&value[USBTMC_STAT_MAX_IN_FLIGHT]);
+
+	if (copy_to_user(arg, &stats, sizeof(stats)))
+		return -EFAULT;
 
-	spin_lock_irqsave(&file_data->err_lock, flags);
-	file_data->out_transfer_size += urb->actual_length;
+	return 0;
+}
 
-	/* sync/async unlink faults aren't errors */
-	if (urb->status) {
-		if (!(urb->status == -ENOENT ||
-			urb->status == -ECONNRESET ||
-			urb->status == -ESHUTDOWN))
-			dev_err(&file_data->data->intf->dev,
-				"%s - nonzero write bulk status received: %d\n",
-				__func__, urb->status);
+static ssize_t usbtmc_ioctl_generic_read(struct usbtmc_file_data *file_data,
+					 void __user *arg)
+{
+	struct usbtmc_message msg;
+	struct iov_iter iter;
+	ssize_t retval = 0;
 
-		if (!file_data->out_status) {
-			file_data->out_status = urb->status;
-			wakeup = 1;
-		}
+	/* mutex already locked */
+
+	if (copy_from_user(&msg, arg, sizeof(struct usbtmc_message)))
+		return -EFAULT;
+
+	/* would receive the responses of USBTMC_IOCTL_QUERY_SUBMIT */
+	if (file_data->data->pending_count)
+		return -EBUSY;
+
+	/* async read may be started without buffer */
+	if (msg.message) {
+		retval = import_ubuf(ITER_DEST, msg.message,
+				     msg.transfer_size, &iter);
+		if (retval)
+			return retval;
 	}
-	spin_unlock_irqrestore(&file_data->err_lock, flags);
 
-	dev_dbg(&file_data->data->intf->dev,
-		"%s - write bulk total size: %u\n",
-		__func__, file_data->out_transfer_size);
+	/* a new transfer restarts the time stamps */
+	if (!(msg.flags & USBTMC_FLAG_ASYNC) || !file_data->in_urbs_used)
+		usbtmc_reset_in_time(file_data);
 
-	up(&file_data->limit_write_sem);
-	if (usb_anchor_empty(&file_data->submitted) || wakeup)
-		wake_up_interruptible(&file_data->data->waitq);
+	retval = usbtmc_generic_read(file_data, msg.message ? &iter : NULL,
+				     msg.transfer_size, &msg.transferred,
+				     msg.flags,
+				     usbtmc_deadline(file_data, msg.flags));
+
+	if (put_user(msg.transferred,
+		     &((struct usbtmc_message __user *)arg)->transferred))
+		return -EFAULT;
+
+	return retval;
 }
 
-static ssize_t usbtmc_generic_write(struct usbtmc_file_data *file_data,
-				    const void __user *user_buffer,
-				    u32 transfer_size,
-				    u32 *transferred,
-				    u32 flags)
+/*
+ * Replaces the buffers of the urb pool by a ring of num_buffers coherent
+ * buffers which can be mapped to user space with mmap().
+ */
+static int usbtmc_ioctl_ring_alloc(struct usbtmc_file_data *file_data,
+				   void __user *arg)
 {
 	struct usbtmc_device_data *data = file_data->data;
-	struct device *dev;
-	u32 done = 0;
-	u32 remaining;
-	unsigned long expire;
-	const u32 bufsize = USBTMC_BUFSIZE;
-	struct urb *urb = NULL;
-	int retval = 0;
-	u32 timeout;
-
-	*transferred = 0;
-
-	/* Get pointer to private data structure */
-	dev = &data->intf->dev;
+	const u32 bufsize = file_data->bufsize;
+	struct usbtmc_ring ring;
+	struct urb **urbs;
+	dma_addr_t dma;
+	u8 *buffer;
+	size_t size;
+	u32 i;
+	int retval;
 
-	dev_dbg(dev, "%s: size=%u flags=0x%X sema=%u\n",
-		__func__, transfer_size, flags,
-		file_data->limit_write_sem.count);
+	/* mutex already locked */
 
-	if (flags & USBTMC_FLAG_APPEND) {
-		spin_lock_irq(&file_data->err_lock);
-		retval = file_data->out_status;
-		spin_unlock_irq(&file_data->err_lock);
-		if (retval < 0)
-			return retval;
-	} else {
-		spin_lock_irq(&file_data->err_lock);
-		file_data->out_transfer_size = 0;
-		file_data->out_status = 0;
-		spin_unlock_irq(&file_data->err_lock);
-	}
+	if (copy_from_user(&ring, arg, sizeof(ring)))
+		return -EFAULT;
 
-	remaining = transfer_size;
-	if (remaining > INT_MAX)
-		remaining = INT_MAX;
+	if (ring.num_buffers < 2 ||
+	    ring.num_buffers > USBTMC_MAX_RING_BUFFERS)
+		return -EINVAL;
 
-	timeout = file_data->timeout;
-	expire = msecs_to_jiffies(timeout);
+	size = PAGE_ALIGN((size_t)ring.num_buffers * bufsize);
+	if (size > USBTMC_MAX_RING_SIZE)
+		return -EINVAL;
 
-	while (remaining > 0) {
-		u32 this_part, aligned;
-		u8 *buffer = NULL;
+	if (file_data->ring_buffer || file_data->streaming ||
+	    file_data->in_urbs_used ||
+	    !usb_anchor_empty(&file_data->submitted) ||
+	    !usb_anchor_empty(&file_data->in_submitted) ||
+	    !usb_anchor_empty(&file_data->in_anchor))
+		return -EBUSY;
 
-		if (flags & USBTMC_FLAG_ASYNC) {
-			if (down_trylock(&file_data->limit_write_sem)) {
-				retval = (done)?(0):(-EAGAIN);
-				goto exit;
-			}
-		} else {
-			retval = down_timeout(&file_data->limit_write_sem,
-					      expire);
-			if (retval < 0) {
-				retval = -ETIMEDOUT;
-				goto error;
-			}
-		}
+	urbs = kcalloc(ring.num_buffers, sizeof(*urbs), GFP_KERNEL);
+	if (!urbs)
+		return -ENOMEM;
 
-		spin_lock_irq(&file_data->err_lock);
-		retval = file_data->out_status;
-		spin_unlock_irq(&file_data->err_lock);
-		if (retval < 0) {
-			up(&file_data->limit_write_sem);
-			goto error;
-		}
+	buffer = usb_alloc_coherent(data->usb_dev, size, GFP_KERNEL, &dma);
+	if (!buffer) {
+		retval = -ENOMEM;
+		goto error;
+	}
 
-		/* prepare next urb to send */
-		urb = usbtmc_create_urb();
-		if (!urb) {
+	for (i = 0; i < ring.num_buffers; i++) {
+		urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urbs[i]) {
 			retval = -ENOMEM;
-			up(&file_data->limit_write_sem);
 			goto error;
 		}
-		buffer = urb->transfer_buffer;
+		urbs[i]->transfer_buffer = buffer + i * bufsize;
+		urbs[i]->transfer_dma = dma + i * bufsize;
+		urbs[i]->transfer_buffer_length = bufsize;
+		urbs[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
 
-		if (remaining > bufsize)
-			this_part = bufsize;
-		else
-			this_part = remaining;
+	ring.buffer_size = bufsize;
+	if (copy_to_user(arg, &ring, sizeof(ring))) {
+		retval = -EFAULT;
+		goto error;
+	}
 
-		if (copy_from_user(buffer, user_buffer + done, this_part)) {
-			retval = -EFAULT;
-			up(&file_data->limit_write_sem);
-			goto error;
-		}
-#if VERBOSE
-		print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
-			16, 1, buffer, this_part, true);
-#endif
-		/* fill bulk with 32 bit alignment to meet USBTMC specification
-		 * (size + 3 & ~3) rounds up and simplifies user code
-		 */
-		aligned = (this_part + 3) & ~3;
-		dev_dbg(dev, "write(size:%u align:%u done:%u)\n",
-			(unsigned int)this_part,
-			(unsigned int)aligned,
-			(unsigned int)done);
+	usbtmc_free_pool(file_data);
+
+	for (i = 0; i < ring.num_buffers; i++) {
+		usb_anchor_urb(urbs[i], &file_data->urb_pool);
+		usb_free_urb(urbs[i]);
+	}
+	bitmap_zero(file_data->ring_loaned, USBTMC_MAX_RING_BUFFERS);
+	file_data->ring_urbs = urbs;
+	file_data->ring_buffer = buffer;
+	file_data->ring_dma = dma;
+	file_data->ring_size = ring.num_buffers;
+	atomic_set(&file_data->pool_size, ring.num_buffers);
+
+	dev_dbg(&data->intf->dev, "%s: %u buffers of %u bytes\n",
+		__func__, ring.num_buffers, bufsize);
+	return 0;
+
+error:
+	for (i = 0; i < ring.num_buffers; i++)
+		usb_free_urb(urbs[i]);
+	if (buffer)
+		usb_free_coherent(data->usb_dev, size, buffer, dma);
+	kfree(urbs);
+	return retval;
+}
+
+/*
+ * Works like an asynchronous usbtmc_generic_read, but does not copy the
+ * received data. Instead the index of the ring buffer holding the data
+ * is returned. The buffer is owned by the user until it is handed back
+ * with USBTMC_IOCTL_RING_RELEASE.
+ */
+static int usbtmc_ring_read(struct usbtmc_file_data *file_data,
+			    struct usbtmc_ring_read *rd)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev = &data->intf->dev;
+	const u32 bufsize = file_data->bufsize;
+	struct urb *urb;
+	int bufcount;
+	int retval;
+	u32 index;
+
+	/* mutex already locked */
+
+	rd->transferred = 0;
+
+	if (file_data->streaming || data->pending_count)
+		return -EBUSY;
+
+	spin_lock_irq(&file_data->err_lock);
+	retval = file_data->in_status;
+	if (!retval && file_data->in_urbs_used == 0) {
+		file_data->in_transfer_size = 0;
+		file_data->in_first_time = 0;
+		file_data->in_last_time = 0;
+	}
+	spin_unlock_irq(&file_data->err_lock);
+	if (retval)
+		goto error;
+
+	bufcount = DIV_ROUND_UP(rd->transfer_size, bufsize);
+	if (bufcount > MAX_URBS_IN_FLIGHT)
+		bufcount = MAX_URBS_IN_FLIGHT;
+	bufcount -= file_data->in_urbs_used;
+
+	/* submit as many urbs as ring buffers are available */
+	while (bufcount > 0) {
+		urb = usbtmc_get_urb(file_data);
+		if (!urb)
+			break;
 
 		usb_fill_bulk_urb(urb, data->usb_dev,
-			usb_sndbulkpipe(data->usb_dev, data->bulk_out),
-			urb->transfer_buffer, aligned,
-			usbtmc_write_bulk_cb, file_data);
+			usb_rcvbulkpipe(data->usb_dev, data->bulk_in),
+			urb->transfer_buffer, bufsize,
+			usbtmc_read_bulk_cb, file_data);
 
-		usb_anchor_urb(urb, &file_data->submitted);
+		usb_anchor_urb(urb, &file_data->in_submitted);
 		retval = usb_submit_urb(urb, GFP_KERNEL);
 		if (unlikely(retval)) {
 			usb_unanchor_urb(urb);
-			up(&file_data->limit_write_sem);
+			usbtmc_put_urb(file_data, urb);
 			goto error;
 		}
-
+		usbtmc_urb_submitted(file_data, urb);
 		usb_free_urb(urb);
-		urb = NULL; /* urb will be finally released by usb driver */
+		file_data->in_urbs_used++;
+		bufcount--;
+	}
 
-		remaining -= this_part;
-		done += this_part;
+	if (!(rd->flags & USBTMC_FLAG_ASYNC)) {
+		/* the user holds all ring buffers, nothing to wait for */
+		if (file_data->in_urbs_used == 0)
+			return -ENOBUFS;
+
+		retval = usbtmc_wait_bulk_in(file_data,
+					     usbtmc_deadline(file_data,
+							     rd->flags));
+		if (retval < 0)
+			goto error;
 	}
 
-	/* All urbs are on the fly */
-	if (!(flags & USBTMC_FLAG_ASYNC)) {
-		if (!usb_wait_anchor_empty_timeout(&file_data->submitted,
-						   timeout)) {
-			retval = -ETIMEDOUT;
+	urb = usb_get_from_anchor(&file_data->in_anchor);
+	if (!urb) {
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->in_status;
+		spin_unlock_irq(&file_data->err_lock);
+		if (retval)
 			goto error;
-		}
+		return -EAGAIN;
 	}
 
-	retval = 0;
-	goto exit;
+	file_data->in_urbs_used--;
 
-error:
-	usb_kill_anchored_urbs(&file_data->submitted);
-exit:
-	usb_free_urb(urb);
+	if (urb->status) {
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->in_status;
+		spin_unlock_irq(&file_data->err_lock);
+		usbtmc_put_urb(file_data, urb);
+		goto error;
+	}
 
-	spin_lock_irq(&file_data->err_lock);
-	if (!(flags & USBTMC_FLAG_ASYNC))
-		done = file_data->out_transfer_size;
-	if (!retval && file_data->out_status)
-		retval = file_data->out_status;
-	spin_unlock_irq(&file_data->err_lock);
+	/* keep reference of urb until the user releases the buffer */
+	index = ((u8 *)urb->transfer_buffer - file_data->ring_buffer) / bufsize;
+	set_bit(index, file_data->ring_loaned);
+	rd->index = index;
+	rd->transferred = urb->actual_length;
 
-	*transferred = done;
+	dev_dbg(dev, "%s: index=%u size=%u used=%d\n", __func__,
+		index, urb->actual_length, file_data->in_urbs_used);
 
-	dev_dbg(dev, "%s: done=%u, retval=%d, urbstat=%d\n",
-		__func__, done, retval, file_data->out_status);
+	/* short packet or ZLP received => ready */
+	if (urb->actual_length < bufsize) {
+		usbtmc_msg_in_done(data);
+		return 1;
+	}
+	return 0;
 
+error:
+	dev_dbg(dev, "%s: ret=%d\n", __func__, retval);
+	usb_kill_anchored_urbs(&file_data->in_submitted);
+	usbtmc_recycle_anchored_urbs(file_data, &file_data->in_anchor);
+	file_data->in_urbs_used = 0;
+	file_data->in_status = 0; /* no spinlock needed here */
 	return retval;
 }
 
-static ssize_t usbtmc_ioctl_generic_write(struct usbtmc_file_data *file_data,
-					  void __user *arg)
+static int usbtmc_ioctl_ring_read(struct usbtmc_file_data *file_data,
+				  void __user *arg)
 {
-	struct usbtmc_message msg;
-	ssize_t retval = 0;
+	struct usbtmc_ring_read rd;
+	int retval;
 
 	/* mutex already locked */
 
-	if (copy_from_user(&msg, arg, sizeof(struct usbtmc_message)))
+	if (!file_data->ring_buffer)
+		return -EINVAL;
+
+	if (copy_from_user(&rd, arg, sizeof(rd)))
 		return -EFAULT;
 
-	retval = usbtmc_generic_write(file_data, msg.message,
-				      msg.transfer_size, &msg.transferred,
-				      msg.flags);
+	retval = usbtmc_ring_read(file_data, &rd);
 
-	if (put_user(msg.transferred,
-		     &((struct usbtmc_message __user *)arg)->transferred))
+	if (copy_to_user(arg, &rd, sizeof(rd)))
 		return -EFAULT;
 
 	return retval;
 }
 
 /*
- * Get the generic write result
+ * Hands a ring buffer back to the driver
  */
-static ssize_t usbtmc_ioctl_write_result(struct usbtmc_file_data *file_data,
-				void __user *arg)
+static int usbtmc_ioctl_ring_release(struct usbtmc_file_data *file_data,
+				     void __user *arg)
 {
-	u32 transferred;
-	int retval;
+	u32 index;
 
-	spin_lock_irq(&file_data->err_lock);
-	transferred = file_data->out_transfer_size;
-	retval = file_data->out_status;
-	spin_unlock_irq(&file_data->err_lock);
+	/* mutex already locked */
 
-	if (put_user(transferred, (__u32 __user *)arg))
+	if (get_user(index, (__u32 __user *)arg))
 		return -EFAULT;
 
-	return retval;
+	if (index >= file_data->ring_size ||
+	    !test_and_clear_bit(index, file_data->ring_loaned))
+		return -EINVAL;
+
+	usbtmc_put_urb(file_data, file_data->ring_urbs[index]);
+	return 0;
 }
 
 /*
- * Sends a REQUEST_DEV_DEP_MSG_IN message on the Bulk-OUT endpoint.
- * @transfer_size: number of bytes to request from the device.
- *
- * See the USBTMC specification, Table 4.
+ * Completion handler of the streaming mode. The received data is copied
+ * into the stream fifo and the urb is resubmitted immediately.
+ */
+static void usbtmc_stream_bulk_cb(struct urb *urb)
+{
+	struct usbtmc_file_data *file_data = urb->context;
+	struct device *dev = &file_data->data->intf->dev;
+	int status = urb->status;
+	unsigned long flags;
+	unsigned int len;
+
+	usbtmc_urb_completed(file_data, urb);
+
+	spin_lock_irqsave(&file_data->err_lock, flags);
+	if (status) {
+		if (!(status == -ENOENT ||
+		      status == -ECONNRESET ||
+		      status == -ESHUTDOWN))
+			dev_err(dev, "%s - nonzero stream status received: %d\n",
+				__func__, status);
+		if (!file_data->stream_status)
+			file_data->stream_status = status;
+		spin_unlock_irqrestore(&file_data->err_lock, flags);
+		goto exit;
+	}
+
+	len = kfifo_in(&file_data->stream_fifo, urb->transfer_buffer,
+		       urb->actual_length);
+	file_data->stream_bytes += len;
+	file_data->stream_dropped += urb->actual_length - len;
+	len = kfifo_len(&file_data->stream_fifo);
+	if (len > file_data->stream_high_water)
+		file_data->stream_high_water = len;
+	usbtmc_signal_event(file_data, USBTMC_EVENT_IN_READY);
+	spin_unlock_irqrestore(&file_data->err_lock, flags);
+
+	usb_anchor_urb(urb, &file_data->stream_anchor);
+	status = usb_submit_urb(urb, GFP_ATOMIC);
+	if (!status) {
+		usbtmc_urb_submitted(file_data, urb);
+		wake_up_interruptible(&file_data->wait_bulk_in);
+		wake_up_interruptible_poll(&file_data->waitq,
+					   EPOLLIN | EPOLLRDNORM);
+		return;
+	}
+
+	/* killed by usbtmc_stream_stop or device gone */
+	usb_unanchor_urb(urb);
+	spin_lock_irqsave(&file_data->err_lock, flags);
+	if (!file_data->stream_status)
+		file_data->stream_status = status;
+	spin_unlock_irqrestore(&file_data->err_lock, flags);
+
+exit:
+	/*
+	 * back to the pool, the anchor holds its own reference. The usb core
+	 * drops its reference after the completion handler.
+	 */
+	usb_anchor_urb(urb, usbtmc_pool_of(file_data, urb));
+	wake_up_interruptible(&file_data->wait_bulk_in);
+	wake_up_interruptible_poll(&file_data->waitq,
+				   EPOLLIN | EPOLLRDNORM | EPOLLERR);
+}
+
+/*
+ * Stops the streaming mode. All urbs are returned to the pool.
+ */
+static void usbtmc_stream_stop(struct usbtmc_file_data *file_data)
+{
+	/* mutex already locked */
+
+	if (!file_data->streaming)
+		return;
+
+	usb_kill_anchored_urbs(&file_data->stream_anchor);
+	file_data->streaming = false;
+	kvfree(file_data->stream_buffer);
+	file_data->stream_buffer = NULL;
+
+	dev_dbg(&file_data->data->intf->dev, "%s: bytes=%llu dropped=%llu\n",
+		__func__, file_data->stream_bytes, file_data->stream_dropped);
+}
+
+/*
+ * Starts the streaming mode: num_urbs bulk in urbs are kept in flight
+ * and resubmitted by usbtmc_stream_bulk_cb until the mode is stopped.
+ */
+static int usbtmc_ioctl_stream_start(struct usbtmc_file_data *file_data,
+				     void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_stream_config config;
+	struct urb *urb;
+	int retval;
+	u32 i;
+
+	/* mutex already locked */
+
+	if (copy_from_user(&config, arg, sizeof(config)))
+		return -EFAULT;
+
+	if (config.num_urbs == 0 || config.num_urbs > MAX_URBS_IN_FLIGHT ||
+	    !is_power_of_2(config.fifo_size) ||
+	    config.fifo_size < USBTMC_MIN_STREAM_FIFO ||
+	    config.fifo_size > USBTMC_MAX_STREAM_FIFO)
+		return -EINVAL;
+
+	if (file_data->streaming || file_data->in_urbs_used ||
+	    data->pending_count ||
+	    !usb_anchor_empty(&file_data->in_anchor))
+		return -EBUSY;
+
+	file_data->stream_buffer = kvmalloc(config.fifo_size, GFP_KERNEL);
+	if (!file_data->stream_buffer)
+		return -ENOMEM;
+	kfifo_init(&file_data->stream_fifo, file_data->stream_buffer,
+		   config.fifo_size);
+
+	spin_lock_irq(&file_data->err_lock);
+	file_data->stream_status = 0;
+	file_data->stream_bytes = 0;
+	file_data->stream_dropped = 0;
+	file_data->stream_high_water = 0;
+	spin_unlock_irq(&file_data->err_lock);
+	file_data->streaming = true;
+
+	for (i = 0; i < config.num_urbs; i++) {
+		urb = usbtmc_get_urb(file_data);
+		if (!urb) {
+			retval = -ENOMEM;
+			goto error;
+		}
+
+		usb_fill_bulk_urb(urb, data->usb_dev,
+			usb_rcvbulkpipe(data->usb_dev, data->bulk_in),
+			urb->transfer_buffer, file_data->bufsize,
+			usbtmc_stream_bulk_cb, file_data);
+
+		usb_anchor_urb(urb, &file_data->stream_anchor);
+		retval = usb_submit_urb(urb, GFP_KERNEL);
+		if (unlikely(retval)) {
+			usb_unanchor_urb(urb);
+			usbtmc_put_urb(file_data, urb);
+			goto error;
+		}
+		usbtmc_urb_submitted(file_data, urb);
+		usb_free_urb(urb);
+	}
+
+	dev_dbg(&data->intf->dev, "%s: urbs=%u fifo=%u\n", __func__,
+		config.num_urbs, config.fifo_size);
+	return 0;
+
+error:
+	usbtmc_stream_stop(file_data);
+	return retval;
+}
+
+/*
+ * Reads data from the stream fifo. Waits for data unless the flag
+ * USBTMC_FLAG_ASYNC is set. An error of the stream is returned when
+ * the fifo is empty.
+ */
+static int usbtmc_ioctl_stream_read(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	struct usbtmc_message msg;
+	unsigned int copied = 0;
+	int retval;
+
+	/* mutex already locked */
+
+	if (copy_from_user(&msg, arg, sizeof(msg)))
+		return -EFAULT;
+
+	if (!file_data->streaming)
+		return -EINVAL;
+
+	if (!(msg.flags & USBTMC_FLAG_ASYNC)) {
+		retval = wait_event_interruptible_timeout(
+			file_data->wait_bulk_in,
+			!kfifo_is_empty(&file_data->stream_fifo) ||
+			READ_ONCE(file_data->stream_status),
+			msecs_to_jiffies(file_data->timeout));
+		if (retval <= 0) {
+			if (retval == 0)
+				retval = -ETIMEDOUT;
+			goto exit;
+		}
+	}
+
+	/* single reader (mutex) and single writer (callback) */
+	retval = kfifo_to_user(&file_data->stream_fifo, msg.message,
+			       msg.transfer_size, &copied);
+	if (!retval && !copied) {
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->stream_status;
+		spin_unlock_irq(&file_data->err_lock);
+		if (!retval)
+			retval = -EAGAIN;
+	}
+
+exit:
+	if (put_user(copied,
+		     &((struct usbtmc_message __user *)arg)->transferred))
+		return -EFAULT;
+
+	return retval;
+}
+
+static int usbtmc_ioctl_stream_stats(struct usbtmc_file_data *file_data,
+				     void __user *arg)
+{
+	struct usbtmc_stream_stats stats;
+
+	/* mutex already locked */
+
+	memset(&stats, 0, sizeof(stats));
+	spin_lock_irq(&file_data->err_lock);
+	stats.bytes = file_data->stream_bytes;
+	stats.dropped = file_data->stream_dropped;
+	stats.high_water = file_data->stream_high_water;
+	stats.status = file_data->stream_status;
+	if (file_data->streaming) {
+		stats.fifo_size = kfifo_size(&file_data->stream_fifo);
+		stats.fifo_level = kfifo_len(&file_data->stream_fifo);
+	}
+	spin_unlock_irq(&file_data->err_lock);
+
+	if (copy_to_user(arg, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* A scatter-gather urb of usbtmc_sg_write and its pinned user pages */
+struct usbtmc_sg_urb {
+	struct usbtmc_file_data *file_data;
+	struct urb *urb;
+	struct scatterlist *sg;
+	struct page **pages;
+	int npages; /* pinned pages, 0 if the urb is not in use */
+	struct completion done;
+};
+
+static void usbtmc_write_done(struct usbtmc_file_data *file_data,
+			      struct urb *urb)
+{
+	int wakeup = 0;
+	unsigned long flags;
+
+	usbtmc_urb_completed(file_data, urb);
+
+	spin_lock_irqsave(&file_data->err_lock, flags);
+	file_data->out_transfer_size += urb->actual_length;
+	file_data->out_done_time = ktime_get();
+
+	/* sync/async unlink faults aren't errors */
+	if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+			urb->status == -ECONNRESET ||
+			urb->status == -ESHUTDOWN))
+			dev_err(&file_data->data->intf->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, urb->status);
+
+		if (!file_data->out_status) {
+			file_data->out_status = urb->status;
+			wakeup = 1;
+		}
+	}
+	spin_unlock_irqrestore(&file_data->err_lock, flags);
+
+	dev_dbg(&file_data->data->intf->dev,
+		"%s - write bulk total size: %u\n",
+		__func__, file_data->out_transfer_size);
+
+	/* sg urbs are owned by usbtmc_sg_write */
+	if (urb->num_sgs) {
+		struct usbtmc_sg_urb *sgu = urb->context;
+
+		complete(&sgu->done);
+	} else {
+		/* the pool anchor holds its own reference of the urb */
+		usb_anchor_urb(urb, usbtmc_pool_of(file_data, urb));
+	}
+	up(&file_data->limit_write_sem);
+	if (usb_anchor_empty(&file_data->submitted)) {
+		spin_lock_irqsave(&file_data->err_lock, flags);
+		usbtmc_signal_event(file_data, USBTMC_EVENT_OUT_DONE);
+		spin_unlock_irqrestore(&file_data->err_lock, flags);
+	}
+	if (usb_anchor_empty(&file_data->submitted) || wakeup)
+		usbtmc_wake_up_poll(file_data, wakeup ? EPOLLERR : 0);
+}
+
+static void usbtmc_write_bulk_cb(struct urb *urb)
+{
+	usbtmc_write_done(urb->context, urb);
+}
+
+static void usbtmc_sg_write_bulk_cb(struct urb *urb)
+{
+	struct usbtmc_sg_urb *sgu = urb->context;
+
+	usbtmc_write_done(sgu->file_data, urb);
+}
+
+/*
+ * Returns true if a synchronous write of size bytes can be sent with
+ * scatter-gather urbs. Without no_sg_constraint each sg entry must be a
+ * multiple of the max packet size, which rules out the header and the
+ * alignment bytes. Pending (asynchronous) urbs must complete first.
+ * Vectors of user buffers (writev) are copied.
+ */
+static bool usbtmc_sg_possible(struct usbtmc_file_data *file_data,
+			       struct iov_iter *iter, u32 size)
+{
+	struct usb_bus *bus = file_data->data->usb_dev->bus;
+
+	return size >= USBTMC_SG_MIN_SIZE &&
+		iter_is_ubuf(iter) &&
+		bus->no_sg_constraint &&
+		bus->sg_tablesize >= USBTMC_SG_MAX_PAGES + 2 &&
+		usb_anchor_empty(&file_data->submitted);
+}
+
+/*
+ * Waits for the completion of the sg urb and unpins its pages. The
+ * completion handler has updated out_transfer_size and out_status.
+ */
+static int usbtmc_sg_wait(struct usbtmc_file_data *file_data,
+			  struct usbtmc_sg_urb *sgu, ktime_t deadline)
+{
+	if (!wait_for_completion_timeout(&sgu->done,
+			usbtmc_timeout_jiffies(file_data, deadline)))
+		return -ETIMEDOUT;
+
+	unpin_user_pages(sgu->pages, sgu->npages);
+	sgu->npages = 0;
+	return 0;
+}
+
+/*
+ * Sends size bytes of the user buffer iter without copying. The pages of
+ * the user buffer are pinned and transferred with up to USBTMC_SG_URBS
+ * scatter-gather urbs in flight, each of them taken from limit_write_sem
+ * like the urbs of usbtmc_generic_write. The optional USBTMC header is sent
+ * with an extra sg entry in front of the data, the alignment bytes of the
+ * last urb with an extra sg entry behind the data.
+ * The sent bytes are accumulated in file_data->out_transfer_size by
+ * usbtmc_write_done.
+ */
+static int usbtmc_sg_write(struct usbtmc_file_data *file_data,
+			   const u8 *header,
+			   struct iov_iter *iter,
+			   u32 size,
+			   ktime_t deadline)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev = &data->intf->dev;
+	u32 hdr_len = header ? USBTMC_HEADER_SIZE : 0;
+	struct usbtmc_sg_urb *sgus;
+	u8 *extra = NULL; /* header and zeroed alignment bytes */
+	u32 done = 0;
+	unsigned int n = 0;
+	int retval = 0;
+	int i;
+
+	sgus = kcalloc(USBTMC_SG_URBS, sizeof(*sgus), GFP_KERNEL);
+	extra = kzalloc(USBTMC_HEADER_SIZE + 4, GFP_KERNEL);
+	if (!sgus || !extra) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+
+	for (i = 0; i < USBTMC_SG_URBS; i++) {
+		struct usbtmc_sg_urb *sgu = &sgus[i];
+
+		sgu->file_data = file_data;
+		init_completion(&sgu->done);
+		sgu->pages = kmalloc_array(USBTMC_SG_MAX_PAGES,
+					   sizeof(*sgu->pages), GFP_KERNEL);
+		sgu->sg = kmalloc_array(USBTMC_SG_MAX_PAGES + 2,
+					sizeof(*sgu->sg), GFP_KERNEL);
+		sgu->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!sgu->pages || !sgu->sg || !sgu->urb) {
+			retval = -ENOMEM;
+			goto exit;
+		}
+	}
+
+	if (header)
+		memcpy(extra, header, USBTMC_HEADER_SIZE);
+
+	while (done < size) {
+		struct usbtmc_sg_urb *sgu = &sgus[n++ % USBTMC_SG_URBS];
+		unsigned long addr = (unsigned long)iter_iov_addr(iter);
+		unsigned int offset = offset_in_page(addr);
+		struct scatterlist *sg = sgu->sg;
+		u32 this_part, len, pad = 0;
+		int npages;
+		int nents = 0;
+
+		/* the urb was submitted USBTMC_SG_URBS urbs before */
+		if (sgu->npages) {
+			retval = usbtmc_sg_wait(file_data, sgu, deadline);
+			if (retval < 0)
+				goto error;
+		}
+
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->out_status;
+		spin_unlock_irq(&file_data->err_lock);
+		if (retval < 0)
+			goto error;
+
+		if (down_timeout(&file_data->limit_write_sem,
+				 usbtmc_timeout_jiffies(file_data,
+							deadline)) < 0) {
+			retval = -ETIMEDOUT;
+			goto error;
+		}
+
+		/* all urbs but the last one are multiples of max packet size */
+		this_part = min_t(u32, size - done, USBTMC_SG_MAX_SIZE - hdr_len);
+		npages = DIV_ROUND_UP(offset + this_part, PAGE_SIZE);
+
+		retval = pin_user_pages_fast(addr & PAGE_MASK, npages, 0,
+					     sgu->pages);
+		if (retval != npages) {
+			if (retval > 0)
+				unpin_user_pages(sgu->pages, retval);
+			if (retval >= 0)
+				retval = -EFAULT;
+			up(&file_data->limit_write_sem);
+			goto error;
+		}
+
+		sg_init_table(sg, npages + 2);
+		if (hdr_len)
+			sg_set_buf(&sg[nents++], extra, hdr_len);
+
+		len = this_part;
+		for (i = 0; i < npages; i++) {
+			u32 part = min_t(u32, len, PAGE_SIZE - offset);
+
+			sg_set_page(&sg[nents++], sgu->pages[i], part, offset);
+			len -= part;
+			offset = 0;
+		}
+
+		/* fill bulk with 32 bit alignment to meet USBTMC specification */
+		if (done + this_part == size) {
+			pad = (4 - ((hdr_len + this_part) & 3)) & 3;
+			if (pad)
+				sg_set_buf(&sg[nents++],
+					   extra + USBTMC_HEADER_SIZE, pad);
+		}
+		sg_mark_end(&sg[nents - 1]);
+
+		dev_dbg(dev, "%s(size:%u pad:%u done:%u sgs:%d)\n", __func__,
+			hdr_len + this_part, pad, done, nents);
+
+		usb_fill_bulk_urb(sgu->urb, data->usb_dev,
+			usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+			NULL, hdr_len + this_part + pad,
+			usbtmc_sg_write_bulk_cb, sgu);
+		sgu->urb->sg = sg;
+		sgu->urb->num_sgs = nents;
+		reinit_completion(&sgu->done);
+
+		usb_anchor_urb(sgu->urb, &file_data->submitted);
+		retval = usb_submit_urb(sgu->urb, GFP_KERNEL);
+		if (unlikely(retval)) {
+			usb_unanchor_urb(sgu->urb);
+			unpin_user_pages(sgu->pages, npages);
+			up(&file_data->limit_write_sem);
+			goto error;
+		}
+		usbtmc_urb_submitted(file_data, sgu->urb);
+		sgu->npages = npages;
+
+		iov_iter_advance(iter, this_part);
+		done += this_part;
+		hdr_len = 0;
+	}
+
+	/* wait for the urbs in flight */
+	for (i = 0; i < USBTMC_SG_URBS; i++) {
+		if (!sgus[i].npages)
+			continue;
+		retval = usbtmc_sg_wait(file_data, &sgus[i], deadline);
+		if (retval < 0)
+			goto error;
+	}
+
+	spin_lock_irq(&file_data->err_lock);
+	retval = file_data->out_status;
+	spin_unlock_irq(&file_data->err_lock);
+	if (retval < 0)
+		goto error;
+	retval = 0;
+	goto exit;
+
+error:
+	/* the completion handlers of the killed urbs have run afterwards */
+	usb_kill_anchored_urbs(&file_data->submitted);
+	for (i = 0; i < USBTMC_SG_URBS; i++) {
+		if (sgus[i].npages)
+			unpin_user_pages(sgus[i].pages, sgus[i].npages);
+	}
+
+exit:
+	if (sgus) {
+		for (i = 0; i < USBTMC_SG_URBS; i++) {
+			usb_free_urb(sgus[i].urb);
+			kfree(sgus[i].sg);
+			kfree(sgus[i].pages);
+		}
+	}
+	kfree(sgus);
+	kfree(extra);
+	return retval;
+}
+
+static ssize_t usbtmc_generic_write(struct usbtmc_file_data *file_data,
+				    struct iov_iter *iter,
+				    u32 transfer_size,
+				    u32 *transferred,
+				    u32 flags,
+				    ktime_t deadline)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev;
+	u32 done = 0;
+	u32 remaining;
+	const u32 bufsize = file_data->bufsize;
+	struct urb *urb = NULL;
+	int retval = 0;
+
+	*transferred = 0;
+
+	/* Get pointer to private data structure */
+	dev = &data->intf->dev;
+
+	dev_dbg(dev, "%s: size=%u flags=0x%X sema=%u\n",
+		__func__, transfer_size, flags,
+		file_data->limit_write_sem.count);
+
+	if (flags & USBTMC_FLAG_APPEND) {
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->out_status;
+		spin_unlock_irq(&file_data->err_lock);
+		if (retval < 0)
+			return retval;
+	} else {
+		spin_lock_irq(&file_data->err_lock);
+		file_data->out_transfer_size = 0;
+		file_data->out_status = 0;
+		spin_unlock_irq(&file_data->err_lock);
+	}
+
+	remaining = transfer_size;
+	if (remaining > INT_MAX)
+		remaining = INT_MAX;
+
+	if (!(flags & USBTMC_FLAG_ASYNC) &&
+	    usbtmc_sg_possible(file_data, iter, remaining)) {
+		retval = usbtmc_sg_write(file_data, NULL, iter, remaining,
+					 deadline);
+		if (retval < 0)
+			goto error;
+		goto exit;
+	}
+
+	while (remaining > 0) {
+		u32 this_part, aligned;
+		u8 *buffer = NULL;
+
+		if (flags & USBTMC_FLAG_ASYNC) {
+			if (down_trylock(&file_data->limit_write_sem)) {
+				retval = (done)?(0):(-EAGAIN);
+				goto exit;
+			}
+		} else {
+			long timeout = usbtmc_timeout_jiffies(file_data,
+							      deadline);
+
+			retval = down_timeout(&file_data->limit_write_sem,
+					      timeout);
+			if (retval < 0) {
+				retval = -ETIMEDOUT;
+				goto error;
+			}
+		}
+
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->out_status;
+		spin_unlock_irq(&file_data->err_lock);
+		if (retval < 0) {
+			up(&file_data->limit_write_sem);
+			goto error;
+		}
+
+		/* prepare next urb to send */
+		urb = usbtmc_get_out_urb(file_data);
+		if (!urb) {
+			retval = -ENOMEM;
+			up(&file_data->limit_write_sem);
+			goto error;
+		}
+		buffer = urb->transfer_buffer;
+
+		if (remaining > bufsize)
+			this_part = bufsize;
+		else
+			this_part = remaining;
+
+		if (copy_from_iter(buffer, this_part, iter) != this_part) {
+			retval = -EFAULT;
+			up(&file_data->limit_write_sem);
+			goto error;
+		}
+#if VERBOSE
+		print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
+			16, 1, buffer, this_part, true);
+#endif
+		/* fill bulk with 32 bit alignment to meet USBTMC specification
+		 * (size + 3 & ~3) rounds up and simplifies user code
+		 */
+		aligned = (this_part + 3) & ~3;
+		dev_dbg(dev, "write(size:%u align:%u done:%u)\n",
+			(unsigned int)this_part,
+			(unsigned int)aligned,
+			(unsigned int)done);
+
+		usb_fill_bulk_urb(urb, data->usb_dev,
+			usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+			urb->transfer_buffer, aligned,
+			usbtmc_write_bulk_cb, file_data);
+
+		usb_anchor_urb(urb, &file_data->submitted);
+		retval = usb_submit_urb(urb, GFP_KERNEL);
+		if (unlikely(retval)) {
+			usb_unanchor_urb(urb);
+			up(&file_data->limit_write_sem);
+			goto error;
+		}
+		usbtmc_urb_submitted(file_data, urb);
+
+		usb_free_urb(urb);
+		urb = NULL; /* urb will be finally released by usb driver */
+
+		remaining -= this_part;
+		done += this_part;
+	}
+
+	/* All urbs are on the fly */
+	if (!(flags & USBTMC_FLAG_ASYNC)) {
+		if (!usbtmc_wait_anchor_empty(file_data, &file_data->submitted,
+					      deadline)) {
+			retval = -ETIMEDOUT;
+			goto error;
+		}
+	}
+
+	retval = 0;
+	goto exit;
+
+error:
+	usb_kill_anchored_urbs(&file_data->submitted);
+exit:
+	if (urb)
+		usbtmc_put_urb(file_data, urb);
+
+	spin_lock_irq(&file_data->err_lock);
+	if (!(flags & USBTMC_FLAG_ASYNC))
+		done = file_data->out_transfer_size;
+	if (!retval && file_data->out_status)
+		retval = file_data->out_status;
+	spin_unlock_irq(&file_data->err_lock);
+
+	*transferred = done;
+
+	dev_dbg(dev, "%s: done=%u, retval=%d, urbstat=%d\n",
+		__func__, done, retval, file_data->out_status);
+
+	return retval;
+}
+
+static ssize_t usbtmc_ioctl_generic_write(struct usbtmc_file_data *file_data,
+					  void __user *arg)
+{
+	struct usbtmc_message msg;
+	struct iov_iter iter;
+	ssize_t retval = 0;
+
+	/* mutex already locked */
+
+	if (copy_from_user(&msg, arg, sizeof(struct usbtmc_message)))
+		return -EFAULT;
+
+	retval = import_ubuf(ITER_SOURCE, msg.message, msg.transfer_size,
+			     &iter);
+	if (retval)
+		return retval;
+
+	retval = usbtmc_generic_write(file_data, &iter,
+				      msg.transfer_size, &msg.transferred,
+				      msg.flags,
+				      usbtmc_deadline(file_data, msg.flags));
+
+	if (put_user(msg.transferred,
+		     &((struct usbtmc_message __user *)arg)->transferred))
+		return -EFAULT;
+
+	return retval;
+}
+
+/*
+ * Get the generic write result
+ */
+static ssize_t usbtmc_ioctl_write_result(struct usbtmc_file_data *file_data,
+				void __user *arg)
+{
+	u32 transferred;
+	int retval;
+
+	spin_lock_irq(&file_data->err_lock);
+	transferred = file_data->out_transfer_size;
+	retval = file_data->out_status;
+	spin_unlock_irq(&file_data->err_lock);
+
+	if (put_user(transferred, (__u32 __user *)arg))
+		return -EFAULT;
+
+	return retval;
+}
+
+/*
+ * Sends a REQUEST_DEV_DEP_MSG_IN message on the Bulk-OUT endpoint.
+ * @transfer_size: number of bytes to request from the device.
+ *
+ * See the USBTMC specification, Table 4.
  *
  * Also updates bTag_last_write.
  */
-static int send_request_dev_dep_msg_in(struct usbtmc_file_data *file_data,
-				       u32 transfer_size)
+static void usbtmc_fill_request_dev_dep_msg_in(struct usbtmc_file_data *file_data,
+					       u8 *buffer, u32 transfer_size)
+{
+	struct usbtmc_device_data *data = file_data->data;
+
+	/* Setup IO buffer for REQUEST_DEV_DEP_MSG_IN message
+	 * Refer to class specs for details
+	 */
+	buffer[0] = 2;
+	buffer[1] = data->bTag;
+	buffer[2] = ~data->bTag;
+	buffer[3] = 0; /* Reserved */
+	buffer[4] = transfer_size >> 0;
+	buffer[5] = transfer_size >> 8;
+	buffer[6] = transfer_size >> 16;
+	buffer[7] = transfer_size >> 24;
+	buffer[8] = file_data->term_char_enabled * 2;
+	/* Use term character? */
+	buffer[9] = file_data->term_char;
+	buffer[10] = 0; /* Reserved */
+	buffer[11] = 0; /* Reserved */
+	trace_usbtmc_header_send(&data->intf->dev, file_data, buffer);
+}
+
+static int send_request_dev_dep_msg_in(struct usbtmc_file_data *file_data,
+				       u32 transfer_size, int timeout)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	int retval;
+	u8 *buffer;
+	int actual = 0;
+
+	buffer = kmalloc(USBTMC_HEADER_SIZE, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	usbtmc_fill_request_dev_dep_msg_in(file_data, buffer, transfer_size);
+
+	/* Send bulk URB */
+	retval = usb_bulk_msg(data->usb_dev,
+			      usb_sndbulkpipe(data->usb_dev,
+					      data->bulk_out),
+			      buffer, USBTMC_HEADER_SIZE,
+			      &actual, timeout);
+	usbtmc_count(file_data, USBTMC_STAT_BYTES_OUT, actual);
+
+	/* Store bTag (in case we need to abort) */
+	data->bTag_last_write = data->bTag;
+
+	/* Increment bTag -- and increment again if zero */
+	data->bTag++;
+	if (!data->bTag)
+		data->bTag++;
+
+	kfree(buffer);
+	if (retval < 0)
+		dev_err(&data->intf->dev, "%s returned %d\n",
+			__func__, retval);
+
+	return retval;
+}
+
+static void usbtmc_free_prefetch(struct usbtmc_file_data *file_data)
+{
+	kvfree(file_data->prefetch.data);
+	memset(&file_data->prefetch, 0, sizeof(file_data->prefetch));
+	file_data->prefetch_pos = 0;
+}
+
+/*
+ * Returns the response read ahead by usbtmc_prefetch_work(). A response
+ * larger than the buffer of read() is returned by subsequent calls.
+ */
+static ssize_t usbtmc_read_prefetch(struct usbtmc_file_data *file_data,
+				    struct iov_iter *to)
+{
+	struct usbtmc_pending *entry = &file_data->prefetch;
+	ssize_t retval = entry->status;
+	size_t n;
+
+	if (retval < 0)
+		goto done;
+
+	n = min_t(size_t, iov_iter_count(to),
+		  entry->size - file_data->prefetch_pos);
+	if (copy_to_iter(entry->data + file_data->prefetch_pos, n, to) != n)
+		return -EFAULT;
+
+	file_data->prefetch_pos += n;
+	retval = n;
+	if (file_data->prefetch_pos < entry->size) {
+		/* no EOM until the last part is read */
+		file_data->bmTransferAttributes = 0;
+		return retval;
+	}
+	file_data->bmTransferAttributes = entry->attributes;
+
+done:
+	usbtmc_free_prefetch(file_data);
+	return retval;
+}
+
+/*
+ * Receives the first Bulk-IN packet of a response. The urb completes in
+ * usbtmc_read_bulk_cb, which takes the time of the header for
+ * in_first_time. The time is reset on error.
+ * Returns the urb, which the caller gives back with usbtmc_put_urb,
+ * or an ERR_PTR.
+ */
+static struct urb *usbtmc_read_first_urb(struct usbtmc_file_data *file_data,
+					 ktime_t deadline)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct urb *urb;
+	int retval;
+
+	spin_lock_irq(&file_data->err_lock);
+	file_data->in_transfer_size = 0;
+	file_data->in_first_time = 0;
+	file_data->in_last_time = 0;
+	file_data->in_status = 0;
+	spin_unlock_irq(&file_data->err_lock);
+
+	urb = usbtmc_get_urb(file_data);
+	if (!urb)
+		return ERR_PTR(file_data->ring_buffer ? -ENOBUFS : -ENOMEM);
+
+	usb_fill_bulk_urb(urb, data->usb_dev,
+		usb_rcvbulkpipe(data->usb_dev, data->bulk_in),
+		urb->transfer_buffer, file_data->bufsize,
+		usbtmc_read_bulk_cb, file_data);
+
+	usb_anchor_urb(urb, &file_data->in_submitted);
+	retval = usb_submit_urb(urb, GFP_KERNEL);
+	if (unlikely(retval)) {
+		usb_unanchor_urb(urb);
+		usbtmc_put_urb(file_data, urb);
+		return ERR_PTR(retval);
+	}
+	usbtmc_urb_submitted(file_data, urb);
+	/* urb is anchored. We can release our reference. */
+	usb_free_urb(urb);
+
+	retval = usbtmc_wait_bulk_in(file_data, deadline);
+	if (retval < 0) {
+		usb_kill_anchored_urbs(&file_data->in_submitted);
+		goto error;
+	}
+
+	urb = usb_get_from_anchor(&file_data->in_anchor);
+	spin_lock_irq(&file_data->err_lock);
+	retval = file_data->in_status;
+	spin_unlock_irq(&file_data->err_lock);
+	if (!urb) {
+		if (!retval)
+			retval = -EFAULT; /* must not happen */
+		goto error;
+	}
+	if (!retval)
+		return urb;
+	usbtmc_put_urb(file_data, urb);
+
+error:
+	usbtmc_recycle_anchored_urbs(file_data, &file_data->in_anchor);
+	file_data->in_status = 0; /* no spinlock needed here */
+	usbtmc_reset_in_time(file_data);
+	return ERR_PTR(retval);
+}
+
+static ssize_t usbtmc_do_read(struct usbtmc_file_data *file_data,
+			      struct iov_iter *to)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev = &data->intf->dev;
+	size_t count = iov_iter_count(to);
+	u32 bufsize;
+	u32 n_characters;
+	struct urb *urb = NULL;
+	u8 *buffer;
+	int actual;
+	u32 done = 0;
+	u32 remaining;
+	int retval;
+	ktime_t deadline = usbtmc_deadline(file_data, 0);
+	u8 tag;
+
+	/* the response announced by an SRQ may be on the way */
+	if (READ_ONCE(file_data->prefetch_size))
+		flush_work(&file_data->prefetch_work);
+
+	usbtmc_lock(data, USBTMC_LOCK_IN);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	if (file_data->prefetch.tag) {
+		retval = usbtmc_read_prefetch(file_data, to);
+		goto exit;
+	}
+
+	bufsize = file_data->bufsize;
+
+	/* the response must not be mixed with asynchronous reads */
+	if (file_data->streaming || data->pending_count ||
+	    file_data->in_urbs_used ||
+	    !usb_anchor_empty(&file_data->in_anchor)) {
+		retval = -EBUSY;
+		goto exit;
+	}
+
+	if (count > INT_MAX)
+		count = INT_MAX;
+
+	dev_dbg(dev, "%s(count:%zu)\n", __func__, count);
+
+	/* other threads may send commands until the response arrives */
+	usbtmc_lock(data, USBTMC_LOCK_OUT);
+	if (down_timeout(&file_data->limit_write_sem,
+			 usbtmc_timeout_jiffies(file_data, deadline)) < 0) {
+		usbtmc_unlock(data, USBTMC_LOCK_OUT);
+		retval = -ETIMEDOUT;
+		goto exit;
+	}
+	spin_lock_irq(&file_data->err_lock);
+	file_data->request_time = 0;
+	spin_unlock_irq(&file_data->err_lock);
+	/* the completion handler takes the time of the request */
+	retval = usbtmc_submit_request(file_data, count);
+	tag = data->bTag_last_write;
+	if (retval < 0) {
+		up(&file_data->limit_write_sem);
+		usbtmc_auto_abort_bulk_out(file_data);
+	}
+	usbtmc_unlock(data, USBTMC_LOCK_OUT);
+
+	if (retval < 0)
+		goto exit;
+
+	/* Loop until we have fetched everything we requested */
+	remaining = count;
+
+	/* later urbs of usbtmc_generic_read update in_last_time */
+	urb = usbtmc_read_first_urb(file_data, deadline);
+
+	/* Store bTag (in case we need to abort) */
+	data->bTag_last_read = tag;
+
+	if (IS_ERR(urb)) {
+		retval = PTR_ERR(urb);
+		urb = NULL;
+		dev_dbg(dev, "%s: first urb retval(%d)\n", __func__, retval);
+		usbtmc_auto_abort_bulk_in(file_data);
+		goto exit;
+	}
+
+	/* parse the header in place */
+	buffer = urb->transfer_buffer;
+	actual = urb->actual_length;
+	dev_dbg(dev, "%s: first urb actual(%d)\n", __func__, actual);
+
+	/* Sanity checks for the header */
+	if (actual < USBTMC_HEADER_SIZE) {
+		dev_err(dev, "Device sent too small first packet: %u < %u\n",
+			actual, USBTMC_HEADER_SIZE);
+		usbtmc_auto_abort_bulk_in(file_data);
+		goto exit;
+	}
+
+	if (buffer[0] != 2) {
+		dev_err(dev, "Device sent reply with wrong MsgID: %u != 2\n",
+			buffer[0]);
+		usbtmc_auto_abort_bulk_in(file_data);
+		goto exit;
+	}
+
+	if (buffer[1] != tag) {
+		dev_err(dev, "Device sent reply with wrong bTag: %u != %u\n",
+		buffer[1], tag);
+		usbtmc_auto_abort_bulk_in(file_data);
+		goto exit;
+	}
+	trace_usbtmc_header_recv(dev, file_data, buffer);
+	spin_lock_irq(&file_data->err_lock);
+	/* the completion of the request may be handled after the response */
+	if (file_data->request_time)
+		usbtmc_hist_add(data, USBTMC_HIST_RESPONSE,
+				file_data->request_time,
+				file_data->in_first_time);
+	spin_unlock_irq(&file_data->err_lock);
+
+	/* How many characters did the instrument send? */
+	n_characters = buffer[4] +
+		       (buffer[5] << 8) +
+		       (buffer[6] << 16) +
+		       (buffer[7] << 24);
+
+	file_data->bmTransferAttributes = buffer[8];
+
+	dev_dbg(dev, "Bulk-IN header: N_characters(%u), bTransAttr(%u)\n",
+		n_characters, buffer[8]);
+
+	if (n_characters > remaining) {
+		dev_err(dev, "Device wants to return more data than requested: %u > %zu\n",
+			n_characters, count);
+		usbtmc_auto_abort_bulk_in(file_data);
+		goto exit;
+	}
+#if VERBOSE
+	print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
+			     16, 1, buffer, actual, true);
+#endif
+	remaining = n_characters;
+
+	/* Remove the USBTMC header */
+	actual -= USBTMC_HEADER_SIZE;
+
+	/* Remove padding if it exists */
+	if (actual > remaining)
+		actual = remaining;
+
+	remaining -= actual;
+
+	/* Copy buffer to user space */
+	if (copy_to_iter(&buffer[USBTMC_HEADER_SIZE], actual, to) != actual) {
+		/* There must have been an addressing problem */
+		retval = -EFAULT;
+		goto exit;
+	}
+
+	/* the pool urb may be needed for the rest of the message */
+	usbtmc_put_urb(file_data, urb);
+	urb = NULL;
+
+	if ((actual + USBTMC_HEADER_SIZE) == bufsize) {
+		retval = usbtmc_generic_read(file_data, to,
+					     remaining,
+					     &done,
+					     USBTMC_FLAG_IGNORE_TRAILER,
+					     deadline);
+		if (retval < 0)
+			goto exit;
+	}
+	done += actual;
+	retval = done;
+
+	if (file_data->bmTransferAttributes & 1) {
+		spin_lock_irq(&file_data->err_lock);
+		usbtmc_hist_add(data, USBTMC_HIST_TRANSFER,
+				file_data->in_first_time,
+				file_data->in_last_time);
+		spin_unlock_irq(&file_data->err_lock);
+	}
+
+exit:
+	if (retval == -ETIMEDOUT)
+		usbtmc_count(file_data, USBTMC_STAT_TIMEOUTS, 1);
+	if (urb)
+		usbtmc_put_urb(file_data, urb);
+	usbtmc_msg_in_done(data);
+	usbtmc_unlock(data, USBTMC_LOCK_IN);
+	return retval;
+}
+
+static ssize_t usbtmc_do_write(struct usbtmc_file_data *file_data,
+			       struct iov_iter *from)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	size_t count = iov_iter_count(from);
+	struct urb *urb = NULL;
+	ssize_t retval = 0;
+	u8 header[USBTMC_HEADER_SIZE];
+	u8 *buffer;
+	u32 remaining, done;
+	u32 transfersize, aligned, buflen;
+	ktime_t deadline = usbtmc_deadline(file_data, 0);
+	ktime_t start;
+
+	usbtmc_lock(data, USBTMC_LOCK_OUT);
+
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	done = 0;
+
+	spin_lock_irq(&file_data->err_lock);
+	file_data->out_transfer_size = 0;
+	file_data->out_status = 0;
+	spin_unlock_irq(&file_data->err_lock);
+
+	if (!count)
+		goto exit;
+
+	if (count > INT_MAX) {
+		transfersize = INT_MAX;
+		header[8] = 0;
+	} else {
+		transfersize = count;
+		header[8] = file_data->eom_val;
+	}
+
+	/* Setup header for DEV_DEP_MSG_OUT message */
+	header[0] = 1;
+	header[1] = data->bTag;
+	header[2] = ~data->bTag;
+	header[3] = 0; /* Reserved */
+	header[4] = transfersize >> 0;
+	header[5] = transfersize >> 8;
+	header[6] = transfersize >> 16;
+	header[7] = transfersize >> 24;
+	/* header[8] is set above... */
+	header[9] = 0; /* Reserved */
+	header[10] = 0; /* Reserved */
+	header[11] = 0; /* Reserved */
+	trace_usbtmc_header_send(&data->intf->dev, file_data, header);
+	usbtmc_msg_out_sent(data, header);
+	start = ktime_get();
+
+	if (usbtmc_sg_possible(file_data, from, transfersize)) {
+		retval = usbtmc_sg_write(file_data, header, from, transfersize,
+					 deadline);
+
+		spin_lock_irq(&file_data->err_lock);
+		done = file_data->out_transfer_size;
+		spin_unlock_irq(&file_data->err_lock);
+		/* subtract header and truncate alignment bytes */
+		done = (done > USBTMC_HEADER_SIZE) ?
+			(done - USBTMC_HEADER_SIZE) : 0;
+		if (done > transfersize)
+			done = transfersize;
+
+		data->bTag_last_write = data->bTag;
+		data->bTag++;
+		if (!data->bTag)
+			data->bTag++;
+		goto check_result;
+	}
+
+	if (down_trylock(&file_data->limit_write_sem)) {
+		/* previous calls were async */
+		retval = -EBUSY;
+		goto exit;
+	}
+
+	urb = usbtmc_get_out_urb(file_data);
+	if (!urb) {
+		retval = -ENOMEM;
+		up(&file_data->limit_write_sem);
+		goto exit;
+	}
+
+	buffer = urb->transfer_buffer;
+	buflen = urb->transfer_buffer_length;
+	memcpy(buffer, header, USBTMC_HEADER_SIZE);
+
+	remaining = transfersize;
+
+	if (transfersize + USBTMC_HEADER_SIZE > buflen) {
+		transfersize = buflen - USBTMC_HEADER_SIZE;
+		aligned = buflen;
+	} else {
+		aligned = (transfersize + (USBTMC_HEADER_SIZE + 3)) & ~3;
+	}
+
+	if (copy_from_iter(&buffer[USBTMC_HEADER_SIZE], transfersize,
+			   from) != transfersize) {
+		retval = -EFAULT;
+		up(&file_data->limit_write_sem);
+		goto exit;
+	}
+
+	dev_dbg(&data->intf->dev, "%s(size:%u align:%u)\n", __func__,
+		(unsigned int)transfersize, (unsigned int)aligned);
+#if VERBOSE
+	print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
+			     16, 1, buffer, aligned, true);
+#endif
+	usb_fill_bulk_urb(urb, data->usb_dev,
+		usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+		urb->transfer_buffer, aligned,
+		usbtmc_write_bulk_cb, file_data);
+
+	usb_anchor_urb(urb, &file_data->submitted);
+	retval = usb_submit_urb(urb, GFP_KERNEL);
+	if (unlikely(retval)) {
+		usb_unanchor_urb(urb);
+		up(&file_data->limit_write_sem);
+		goto exit;
+	}
+	usbtmc_urb_submitted(file_data, urb);
+
+	usb_free_urb(urb);
+	urb = NULL; /* urb will be returned to pool by usbtmc_write_bulk_cb */
+
+	remaining -= transfersize;
+
+	data->bTag_last_write = data->bTag;
+	data->bTag++;
+
+	if (!data->bTag)
+		data->bTag++;
+
+	/* call generic_write even when remaining = 0 */
+	retval = usbtmc_generic_write(file_data, from, remaining,
+				      &done, USBTMC_FLAG_APPEND, deadline);
+	/* truncate alignment bytes */
+	if (done > remaining)
+		done = remaining;
+
+	/*add size of first urb*/
+	done += transfersize;
+
+check_result:
+	if (retval < 0) {
+		usb_kill_anchored_urbs(&file_data->submitted);
+
+		dev_err(&data->intf->dev,
+			"Unable to send data, error %d\n", (int)retval);
+		usbtmc_auto_abort_bulk_out(file_data);
+		goto exit;
+	}
+
+	spin_lock_irq(&file_data->err_lock);
+	usbtmc_hist_add(data, USBTMC_HIST_OUT, start, file_data->out_done_time);
+	spin_unlock_irq(&file_data->err_lock);
+
+	retval = done;
+exit:
+	if (retval == -ETIMEDOUT)
+		usbtmc_count(file_data, USBTMC_STAT_TIMEOUTS, 1);
+	if (urb)
+		usbtmc_put_urb(file_data, urb);
+	usbtmc_unlock(data, USBTMC_LOCK_OUT);
+	return retval;
+}
+
+/* asynchronous read_iter/write_iter request */
+struct usbtmc_iocb {
+	struct work_struct work;
+	struct kiocb *iocb;
+	struct usbtmc_file_data *file_data;
+	struct iov_iter iter;
+	const void *to_free; /* copy of iovec array */
+	struct mm_struct *mm;
+	bool write;
+};
+
+static void usbtmc_iocb_work(struct work_struct *work)
+{
+	struct usbtmc_iocb *p = container_of(work, struct usbtmc_iocb, work);
+	ssize_t retval;
+
+	kthread_use_mm(p->mm);
+	if (p->write)
+		retval = usbtmc_do_write(p->file_data, &p->iter);
+	else
+		retval = usbtmc_do_read(p->file_data, &p->iter);
+	kthread_unuse_mm(p->mm);
+	mmput(p->mm);
+
+	if (retval > 0 && !p->write)
+		p->iocb->ki_pos += retval;
+	p->iocb->ki_complete(p->iocb, retval);
+
+	kfree(p->to_free);
+	kfree(p);
+}
+
+/*
+ * Queues an asynchronous (AIO or io_uring) request to the ordered
+ * workqueue of the device. The request is completed with ki_complete
+ * in the same order as submitted.
+ */
+static ssize_t usbtmc_queue_iocb(struct kiocb *iocb, struct iov_iter *iter,
+				 bool write)
+{
+	struct usbtmc_file_data *file_data = iocb->ki_filp->private_data;
+	struct usbtmc_iocb *p;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	p->to_free = dup_iter(&p->iter, iter, GFP_KERNEL);
+	if (!iter_is_ubuf(&p->iter) && !p->to_free) {
+		kfree(p);
+		return -ENOMEM;
+	}
+
+	p->iocb = iocb;
+	p->file_data = file_data;
+	p->write = write;
+	p->mm = current->mm;
+	mmget(p->mm);
+
+	INIT_WORK(&p->work, usbtmc_iocb_work);
+	queue_work(file_data->data->iocb_wq, &p->work);
+
+	return -EIOCBQUEUED;
+}
+
+/*
+ * Read with IOCB_NOWAIT. Only a response read ahead after an SRQ with MAV
+ * is returned without waiting for the device.
+ */
+static ssize_t usbtmc_read_nowait(struct usbtmc_file_data *file_data,
+				  struct iov_iter *to)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	ssize_t retval = -EAGAIN;
+
+	/* the read ahead holds in_mutex until the response is complete */
+	if (!mutex_trylock(&data->in_mutex))
+		return -EAGAIN;
+
+	if (data->zombie)
+		retval = -ENODEV;
+	else if (file_data->prefetch.tag)
+		retval = usbtmc_read_prefetch(file_data, to);
+
+	mutex_unlock(&data->in_mutex);
+	return retval;
+}
+
+static ssize_t usbtmc_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t retval;
+
+	if (!is_sync_kiocb(iocb))
+		return usbtmc_queue_iocb(iocb, to, false);
+
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		retval = usbtmc_read_nowait(iocb->ki_filp->private_data, to);
+	else
+		retval = usbtmc_do_read(iocb->ki_filp->private_data, to);
+	/* Update file position value */
+	if (retval > 0)
+		iocb->ki_pos += retval;
+
+	return retval;
+}
+
+static ssize_t usbtmc_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	if (!is_sync_kiocb(iocb))
+		return usbtmc_queue_iocb(iocb, from, true);
+
+	/* each write waits for the completion of its urbs */
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return -EAGAIN;
+
+	return usbtmc_do_write(iocb->ki_filp->private_data, from);
+}
+
+/*
+ * Submits an urb anchored to the given anchor of the file handle. On
+ * success the reference of the caller is released. The context of the
+ * urb must be the file handle.
+ */
+static int usbtmc_submit_anchored_urb(struct urb *urb,
+				      struct usb_anchor *anchor)
+{
+	int retval;
+
+	usb_anchor_urb(urb, anchor);
+	retval = usb_submit_urb(urb, GFP_KERNEL);
+	if (unlikely(retval)) {
+		usb_unanchor_urb(urb);
+		return retval;
+	}
+	usbtmc_urb_submitted(urb->context, urb);
+	/* urb is anchored. We can release our reference. */
+	usb_free_urb(urb);
+	return 0;
+}
+
+/*
+ * Submits a DEV_DEP_MSG_OUT urb with a command of size bytes. The caller
+ * has to take limit_write_sem, which is released by usbtmc_write_bulk_cb.
+ * Returns the number of bytes to send including header and alignment
+ * bytes or a negative error code.
+ */
+static int usbtmc_submit_command(struct usbtmc_file_data *file_data,
+				 const void __user *command, u32 size)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct urb *urb;
+	u32 aligned;
+	u8 *buffer;
+	int retval;
+
+	if (size > file_data->bufsize - USBTMC_HEADER_SIZE)
+		return -EINVAL;
+
+	urb = usbtmc_get_out_urb(file_data);
+	if (!urb)
+		return -ENOMEM;
+
+	buffer = urb->transfer_buffer;
+	buffer[0] = 1;
+	buffer[1] = data->bTag;
+	buffer[2] = ~data->bTag;
+	buffer[3] = 0; /* Reserved */
+	buffer[4] = size >> 0;
+	buffer[5] = size >> 8;
+	buffer[6] = size >> 16;
+	buffer[7] = size >> 24;
+	buffer[8] = file_data->eom_val;
+	buffer[9] = 0; /* Reserved */
+	buffer[10] = 0; /* Reserved */
+	buffer[11] = 0; /* Reserved */
+	trace_usbtmc_header_send(&data->intf->dev, file_data, buffer);
+	usbtmc_msg_out_sent(data, buffer);
+
+	if (copy_from_user(&buffer[USBTMC_HEADER_SIZE], command, size)) {
+		retval = -EFAULT;
+		goto error;
+	}
+	aligned = (size + (USBTMC_HEADER_SIZE + 3)) & ~3;
+	memset(&buffer[USBTMC_HEADER_SIZE + size], 0,
+	       aligned - USBTMC_HEADER_SIZE - size);
+
+	usb_fill_bulk_urb(urb, data->usb_dev,
+		usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+		urb->transfer_buffer, aligned,
+		usbtmc_write_bulk_cb, file_data);
+
+	retval = usbtmc_submit_anchored_urb(urb, &file_data->submitted);
+	if (retval)
+		goto error;
+
+	data->bTag_last_write = data->bTag;
+	data->bTag++;
+	if (!data->bTag)
+		data->bTag++;
+
+	return aligned;
+
+error:
+	usbtmc_put_urb(file_data, urb);
+	return retval;
+}
+
+/* Takes the time of a REQUEST_DEV_DEP_MSG_IN for USBTMC_HIST_RESPONSE */
+static void usbtmc_request_bulk_cb(struct urb *urb)
+{
+	struct usbtmc_file_data *file_data = urb->context;
+	unsigned long flags;
+
+	if (!urb->status) {
+		spin_lock_irqsave(&file_data->err_lock, flags);
+		file_data->request_time = ktime_get();
+		spin_unlock_irqrestore(&file_data->err_lock, flags);
+	}
+	usbtmc_write_bulk_cb(urb);
+}
+
+/*
+ * Submits a REQUEST_DEV_DEP_MSG_IN urb for transfer_size bytes. The caller
+ * has to take limit_write_sem, which is released by usbtmc_write_bulk_cb.
+ * Returns the bTag of the request or a negative error code.
+ */
+static int usbtmc_submit_request(struct usbtmc_file_data *file_data,
+				 u32 transfer_size)
 {
 	struct usbtmc_device_data *data = file_data->data;
+	struct urb *urb;
 	int retval;
-	u8 *buffer;
-	int actual;
 
-	buffer = kmalloc(USBTMC_HEADER_SIZE, GFP_KERNEL);
-	if (!buffer)
+	urb = usbtmc_get_out_urb(file_data);
+	if (!urb)
 		return -ENOMEM;
-	/* Setup IO buffer for REQUEST_DEV_DEP_MSG_IN message
-	 * Refer to class specs for details
-	 */
-	buffer[0] = 2;
-	buffer[1] = data->bTag;
-	buffer[2] = ~data->bTag;
-	buffer[3] = 0; /* Reserved */
-	buffer[4] = transfer_size >> 0;
-	buffer[5] = transfer_size >> 8;
-	buffer[6] = transfer_size >> 16;
-	buffer[7] = transfer_size >> 24;
-	buffer[8] = file_data->term_char_enabled * 2;
-	/* Use term character? */
-	buffer[9] = file_data->term_char;
-	buffer[10] = 0; /* Reserved */
-	buffer[11] = 0; /* Reserved */
 
-	/* Send bulk URB */
-	retval = usb_bulk_msg(data->usb_dev,
-			      usb_sndbulkpipe(data->usb_dev,
-					      data->bulk_out),
-			      buffer, USBTMC_HEADER_SIZE,
-			      &actual, file_data->timeout);
+	usbtmc_fill_request_dev_dep_msg_in(file_data, urb->transfer_buffer,
+					   transfer_size);
+	usb_fill_bulk_urb(urb, data->usb_dev,
+		usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+		urb->transfer_buffer, USBTMC_HEADER_SIZE,
+		usbtmc_request_bulk_cb, file_data);
 
-	/* Store bTag (in case we need to abort) */
+	retval = usbtmc_submit_anchored_urb(urb, &file_data->submitted);
+	if (retval) {
+		usbtmc_put_urb(file_data, urb);
+		return retval;
+	}
+
+	retval = data->bTag;
 	data->bTag_last_write = data->bTag;
+	data->bTag_last_read = data->bTag;
+	data->bTag++;
+	if (!data->bTag)
+		data->bTag++;
+
+	return retval;
+}
+
+/*
+ * Sends a command with a DEV_DEP_MSG_OUT message and reads the response
+ * of the device. The bulk in urb, the DEV_DEP_MSG_OUT urb and the
+ * REQUEST_DEV_DEP_MSG_IN urb are submitted back-to-back, thus a short
+ * query needs only one call and a single round trip.
+ */
+static int usbtmc_query(struct usbtmc_file_data *file_data,
+			struct usbtmc_query *query, ktime_t deadline)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev = &data->intf->dev;
+	const u32 bufsize = file_data->bufsize;
+	struct urb *urb = NULL;
+	struct iov_iter iter;
+	u32 n_characters;
+	u32 actual;
+	u32 done = 0;
+	u32 received;
+	int sems = 0; /* taken from limit_write_sem, but not submitted */
+	bool request_sent = false;
+	u8 *buffer;
+	int retval;
+
+	/* mutex already locked */
+
+	query->transferred = 0;
+
+	/* the command must fit into a single urb */
+	if (query->out_size > bufsize - USBTMC_HEADER_SIZE ||
+	    query->in_size > INT_MAX)
+		return -EINVAL;
+
+	/* previous asynchronous transfers must be finished */
+	if (file_data->streaming || data->pending_count ||
+	    file_data->in_urbs_used ||
+	    !usb_anchor_empty(&file_data->submitted) ||
+	    !usb_anchor_empty(&file_data->in_submitted) ||
+	    !usb_anchor_empty(&file_data->in_anchor))
+		return -EBUSY;
+
+	for (sems = 0; sems < 2; sems++) {
+		long timeout = usbtmc_timeout_jiffies(file_data, deadline);
+
+		if (down_timeout(&file_data->limit_write_sem, timeout) < 0) {
+			retval = -ETIMEDOUT;
+			goto error;
+		}
+	}
+
+	spin_lock_irq(&file_data->err_lock);
+	file_data->in_transfer_size = 0;
+	file_data->in_first_time = 0;
+	file_data->in_last_time = 0;
+	file_data->in_status = 0;
+	file_data->out_transfer_size = 0;
+	file_data->out_status = 0;
+	spin_unlock_irq(&file_data->err_lock);
+
+	/* 1. Bulk in urb to receive the response */
+	urb = usbtmc_get_urb(file_data);
+	if (!urb) {
+		retval = -ENOMEM;
+		goto error;
+	}
+	usb_fill_bulk_urb(urb, data->usb_dev,
+		usb_rcvbulkpipe(data->usb_dev, data->bulk_in),
+		urb->transfer_buffer, bufsize,
+		usbtmc_read_bulk_cb, file_data);
+
+	retval = usbtmc_submit_anchored_urb(urb, &file_data->in_submitted);
+	if (retval)
+		goto error;
+	urb = NULL;
+	file_data->in_urbs_used++;
+
+	/* 2. DEV_DEP_MSG_OUT with the command */
+	retval = usbtmc_submit_command(file_data, query->out_message,
+				       query->out_size);
+	if (retval < 0)
+		goto error;
+	sems--;
+
+	/* 3. REQUEST_DEV_DEP_MSG_IN for the response */
+	retval = usbtmc_submit_request(file_data, query->in_size);
+	if (retval < 0)
+		goto error;
+	sems--;
+	request_sent = true;
+
+	/* 4. Wait for the response */
+	retval = usbtmc_wait_bulk_in(file_data, deadline);
+	if (retval < 0)
+		goto error;
+
+	urb = usb_get_from_anchor(&file_data->in_anchor);
+	if (!urb) {
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->in_status;
+		spin_unlock_irq(&file_data->err_lock);
+		if (!retval)
+			retval = -EFAULT; /* must not happen */
+		goto error;
+	}
+	file_data->in_urbs_used--;
+
+	if (urb->status) {
+		spin_lock_irq(&file_data->err_lock);
+		retval = file_data->in_status;
+		spin_unlock_irq(&file_data->err_lock);
+		goto error;
+	}
+
+	buffer = urb->transfer_buffer;
+	actual = urb->actual_length;
+#if VERBOSE
+	print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
+			     16, 1, buffer, actual, true);
+#endif
+	/* Sanity checks for the header */
+	if (actual < USBTMC_HEADER_SIZE || buffer[0] != 2 ||
+	    buffer[1] != data->bTag_last_write) {
+		dev_err(dev, "Device sent invalid response (size %u)\n",
+			actual);
+		retval = -EPROTO;
+		goto error;
+	}
+	trace_usbtmc_header_recv(dev, file_data, buffer);
+
+	n_characters = buffer[4] +
+		       (buffer[5] << 8) +
+		       (buffer[6] << 16) +
+		       (buffer[7] << 24);
+
+	if (n_characters > query->in_size) {
+		dev_err(dev, "Device wants to return more data than requested: %u > %u\n",
+			n_characters, query->in_size);
+		retval = -EPROTO;
+		goto error;
+	}
+
+	file_data->bmTransferAttributes = buffer[8];
+	query->bmTransferAttributes = buffer[8];
+
+	/* Remove the USBTMC header and padding */
+	done = actual - USBTMC_HEADER_SIZE;
+	if (done > n_characters)
+		done = n_characters;
+
+	retval = import_ubuf(ITER_DEST, query->in_message, n_characters,
+			     &iter);
+	if (retval)
+		goto error;
+
+	if (copy_to_iter(&buffer[USBTMC_HEADER_SIZE], done, &iter) != done) {
+		retval = -EFAULT;
+		goto error;
+	}
+
+	usbtmc_put_urb(file_data, urb);
+	urb = NULL;
+
+	if (actual == bufsize) {
+		retval = usbtmc_generic_read(file_data, &iter,
+					     n_characters - done,
+					     &received,
+					     USBTMC_FLAG_IGNORE_TRAILER,
+					     deadline);
+		if (retval < 0)
+			goto error;
+		done += received;
+	}
+
+	/* OUT urbs are done, when the response arrived */
+	if (!usbtmc_wait_anchor_empty(file_data, &file_data->submitted,
+				      deadline)) {
+		retval = -ETIMEDOUT;
+		goto error;
+	}
+	retval = 0;
+	goto exit;
+
+error:
+	if (urb)
+		usbtmc_put_urb(file_data, urb);
+	while (sems-- > 0)
+		up(&file_data->limit_write_sem);
+	usb_kill_anchored_urbs(&file_data->submitted);
+	usb_kill_anchored_urbs(&file_data->in_submitted);
+	usbtmc_recycle_anchored_urbs(file_data, &file_data->in_anchor);
+	file_data->in_urbs_used = 0;
+	file_data->in_status = 0; /* no spinlock needed here */
+
+	dev_dbg(dev, "%s: ret=%d\n", __func__, retval);
+	if (retval != -EFAULT) {
+		if (request_sent)
+			usbtmc_auto_abort_bulk_in(file_data);
+		else
+			usbtmc_auto_abort_bulk_out(file_data);
+	}
+exit:
+	if (!retval)
+		usbtmc_msg_in_done(data);
+	query->transferred = done;
+	return retval;
+}
+
+static int usbtmc_ioctl_query(struct usbtmc_file_data *file_data,
+			      void __user *arg)
+{
+	struct usbtmc_query query;
+	int retval;
+
+	/* mutex already locked */
+
+	if (copy_from_user(&query, arg, sizeof(query)))
+		return -EFAULT;
+
+	retval = usbtmc_query(file_data, &query, usbtmc_deadline(file_data, 0));
+
+	if (copy_to_user(arg, &query, sizeof(query)))
+		return -EFAULT;
+
+	return retval;
+}
+
+/*
+ * Waits until the commands first ... last - 1 of a batch are sent and sets
+ * their status. ends[i] is the number of bytes sent up to the end of
+ * command i. The first failed command gets the error, the following
+ * commands -ECANCELED.
+ */
+static int usbtmc_batch_flush(struct usbtmc_file_data *file_data,
+			      struct usbtmc_batch_msg *msgs, const u32 *ends,
+			      u32 first, u32 last, ktime_t deadline)
+{
+	u32 sent;
+	int retval = 0;
+	u32 i;
+
+	if (first == last)
+		return 0;
+
+	if (!usbtmc_wait_anchor_empty(file_data, &file_data->submitted,
+				      deadline)) {
+		usb_kill_anchored_urbs(&file_data->submitted);
+		retval = -ETIMEDOUT;
+	}
+
+	spin_lock_irq(&file_data->err_lock);
+	sent = file_data->out_transfer_size;
+	if (!retval)
+		retval = file_data->out_status;
+	spin_unlock_irq(&file_data->err_lock);
+
+	for (i = first; i < last; i++) {
+		if (ends[i] <= sent) {
+			msgs[i].status = 0;
+			msgs[i].query.transferred = msgs[i].query.out_size;
+			continue;
+		}
+		/* attribute the error to the first incomplete command */
+		if (!retval)
+			retval = -EIO;
+		msgs[i].status = retval;
+		break;
+	}
+
+	return retval;
+}
+
+/*
+ * Processes a vector of commands and queries with a single call.
+ * Subsequent commands without response (in_size = 0) are submitted
+ * without waiting for each other. Queries wait until the preceding
+ * commands are sent.
+ */
+static int usbtmc_ioctl_batch(struct usbtmc_file_data *file_data,
+			      void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_batch batch;
+	struct usbtmc_batch_msg *msgs;
+	ktime_t deadline;
+	u32 *ends = NULL;
+	u32 first = 0; /* first command not yet flushed */
+	u32 sent = 0;
+	u32 i;
+	bool out_error = false;
+	int status;
+	int retval = 0;
+
+	/* mutex already locked */
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.count == 0 || batch.count > USBTMC_MAX_BATCH_MSGS)
+		return -EINVAL;
+
+	/* previous asynchronous transfers must be finished */
+	if (data->pending_count || file_data->in_urbs_used ||
+	    !usb_anchor_empty(&file_data->submitted) ||
+	    !usb_anchor_empty(&file_data->in_submitted) ||
+	    !usb_anchor_empty(&file_data->in_anchor))
+		return -EBUSY;
+
+	msgs = memdup_user(batch.msgs, batch.count * sizeof(*msgs));
+	if (IS_ERR(msgs))
+		return PTR_ERR(msgs);
+
+	ends = kcalloc(batch.count, sizeof(*ends), GFP_KERNEL);
+	if (!ends) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		msgs[i].status = -ECANCELED;
+		msgs[i].query.transferred = 0;
+	}
+
+	/* all commands and queries share one deadline */
+	deadline = usbtmc_deadline(file_data, 0);
+
+	for (i = 0; i < batch.count; i++) {
+		struct usbtmc_batch_msg *msg = &msgs[i];
+
+		if (msg->query.in_size) {
+			retval = usbtmc_batch_flush(file_data, msgs, ends,
+						    first, i, deadline);
+			if (retval < 0) {
+				out_error = true;
+				goto error;
+			}
+
+			retval = usbtmc_query(file_data, &msg->query,
+					      deadline);
+			msg->status = retval;
+			if (retval < 0)
+				goto error;
+			first = i + 1;
+			continue;
+		}
+
+		if (first == i) {
+			/* start of a new sequence of commands */
+			spin_lock_irq(&file_data->err_lock);
+			file_data->out_transfer_size = 0;
+			file_data->out_status = 0;
+			spin_unlock_irq(&file_data->err_lock);
+			sent = 0;
+		}
+
+		if (down_timeout(&file_data->limit_write_sem,
+				 usbtmc_timeout_jiffies(file_data,
+							deadline)) < 0) {
+			retval = -ETIMEDOUT;
+			msg->status = retval;
+			break;
+		}
+
+		retval = usbtmc_submit_command(file_data, msg->query.out_message,
+					       msg->query.out_size);
+		if (retval < 0) {
+			up(&file_data->limit_write_sem);
+			msg->status = retval;
+			break;
+		}
+		sent += retval;
+		ends[i] = sent;
+	}
 
-	/* Increment bTag -- and increment again if zero */
-	data->bTag++;
-	if (!data->bTag)
-		data->bTag++;
+	/* wait for the pending commands, an error of them comes first */
+	status = usbtmc_batch_flush(file_data, msgs, ends, first, i,
+				    deadline);
+	if (status < 0 || retval >= 0)
+		retval = status;
+	out_error = (retval < 0);
 
-	kfree(buffer);
-	if (retval < 0)
-		dev_err(&data->intf->dev, "%s returned %d\n",
+error:
+	if (retval < 0) {
+		dev_dbg(&data->intf->dev, "%s: failed: %d\n",
 			__func__, retval);
+		if (out_error)
+			usbtmc_auto_abort_bulk_out(file_data);
+	}
+
+	if (copy_to_user(batch.msgs, msgs, batch.count * sizeof(*msgs)))
+		retval = -EFAULT;
 
+exit:
+	kfree(ends);
+	kfree(msgs);
 	return retval;
 }
 
-static ssize_t usbtmc_read(struct file *filp, char __user *buf,
-			   size_t count, loff_t *f_pos)
+/*
+ * Frees the response of a pending request and releases the entry.
+ */
+static void usbtmc_free_pending(struct usbtmc_file_data *file_data,
+				struct usbtmc_pending *entry)
 {
-	struct usbtmc_file_data *file_data;
-	struct usbtmc_device_data *data;
-	struct device *dev;
-	const u32 bufsize = USBTMC_BUFSIZE;
+	kvfree(entry->data);
+	memset(entry, 0, sizeof(*entry));
+	file_data->pending_count--;
+	file_data->data->pending_count--;
+}
+
+/*
+ * Marks all pending requests without response as failed. The responses
+ * cannot be assigned any more after an error.
+ */
+static void usbtmc_fail_pending(struct usbtmc_file_data *file_data,
+				int status)
+{
+	struct usbtmc_pending *entry;
+	int i;
+
+	for (i = 0; i < USBTMC_MAX_PENDING; i++) {
+		entry = &file_data->pending[i];
+		if (!entry->tag || entry->done)
+			continue;
+		kvfree(entry->data);
+		entry->data = NULL;
+		entry->size = 0;
+		entry->status = status;
+		entry->done = true;
+	}
+}
+
+static void usbtmc_clear_pending(struct usbtmc_file_data *file_data)
+{
+	int i;
+
+	for (i = 0; i < USBTMC_MAX_PENDING; i++) {
+		if (file_data->pending[i].tag)
+			usbtmc_free_pending(file_data, &file_data->pending[i]);
+	}
+}
+
+/*
+ * Reads a complete Bulk-IN transfer and stores the response in entry or,
+ * if entry is NULL, in the pending entry with the matching bTag.
+ */
+static int usbtmc_receive_pending(struct usbtmc_file_data *file_data,
+				  struct usbtmc_pending *entry)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev = &data->intf->dev;
+	const u32 bufsize = file_data->bufsize;
+	ktime_t deadline = usbtmc_deadline(file_data, 0);
+	struct iov_iter iter;
+	struct kvec kvec;
+	struct urb *urb;
 	u32 n_characters;
+	u32 done, n;
 	u8 *buffer;
 	int actual;
-	u32 done = 0;
-	u32 remaining;
 	int retval;
+	int i;
 
-	/* Get pointer to private data structure */
-	file_data = filp->private_data;
-	data = file_data->data;
-	dev = &data->intf->dev;
-
-	buffer = kmalloc(bufsize, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	urb = usbtmc_read_first_urb(file_data, deadline);
+	if (IS_ERR(urb))
+		return PTR_ERR(urb);
 
-	mutex_lock(&data->io_mutex);
-	if (data->zombie) {
-		retval = -ENODEV;
+	buffer = urb->transfer_buffer;
+	actual = urb->actual_length;
+	if (actual < USBTMC_HEADER_SIZE || buffer[0] != 2) {
+		dev_err(dev, "Device sent invalid response (size %d)\n",
+			actual);
+		retval = -EPROTO;
+		goto exit;
+	}
+	trace_usbtmc_header_recv(dev, file_data, buffer);
+
+	if (!entry) {
+		for (i = 0; i < USBTMC_MAX_PENDING; i++) {
+			if (file_data->pending[i].tag == buffer[1] &&
+			    !file_data->pending[i].done) {
+				entry = &file_data->pending[i];
+				break;
+			}
+		}
+	} else if (entry->tag != buffer[1]) {
+		entry = NULL;
+	}
+	if (!entry) {
+		dev_err(dev, "Device sent reply with unknown bTag: %u\n",
+			buffer[1]);
+		retval = -EPROTO;
 		goto exit;
 	}
 
-	if (count > INT_MAX)
-		count = INT_MAX;
-
-	dev_dbg(dev, "%s(count:%zu)\n", __func__, count);
+	n_characters = buffer[4] +
+		       (buffer[5] << 8) +
+		       (buffer[6] << 16) +
+		       (buffer[7] << 24);
 
-	retval = send_request_dev_dep_msg_in(file_data, count);
+	if (n_characters > entry->in_size) {
+		dev_err(dev, "Device wants to return more data than requested: %u > %u\n",
+			n_characters, entry->in_size);
+		retval = -EPROTO;
+		goto exit;
+	}
 
-	if (retval < 0) {
-		if (file_data->auto_abort)
-			usbtmc_ioctl_abort_bulk_out(data);
+	entry->data = kvmalloc(max_t(u32, n_characters, 1), GFP_KERNEL);
+	if (!entry->data) {
+		retval = -ENOMEM;
 		goto exit;
 	}
+	entry->attributes = buffer[8];
+
+	/* Remove the USBTMC header and padding */
+	done = min_t(u32, actual - USBTMC_HEADER_SIZE, n_characters);
+	memcpy(entry->data, &buffer[USBTMC_HEADER_SIZE], done);
+
+	/* the pool urb may be needed for the rest of the message */
+	usbtmc_put_urb(file_data, urb);
+	urb = NULL;
+
+	if (actual == bufsize) {
+		/* bounded by n_characters and the padding of the device */
+		kvec.iov_base = entry->data + done;
+		kvec.iov_len = n_characters - done;
+		iov_iter_kvec(&iter, ITER_DEST, &kvec, 1, kvec.iov_len);
+		retval = usbtmc_generic_read(file_data, &iter,
+					     n_characters - done, &n,
+					     USBTMC_FLAG_IGNORE_TRAILER,
+					     deadline);
+		if (retval < 0) {
+			kvfree(entry->data);
+			entry->data = NULL;
+			goto exit;
+		}
+		done += n;
+	}
 
-	/* Loop until we have fetched everything we requested */
-	remaining = count;
-	actual = 0;
+	dev_dbg(dev, "%s: bTag=%u size=%u\n", __func__, entry->tag, done);
+	entry->size = done;
+	entry->done = true;
+	usbtmc_msg_in_done(data);
+	retval = 0;
 
-	/* Send bulk URB */
-	retval = usb_bulk_msg(data->usb_dev,
-			      usb_rcvbulkpipe(data->usb_dev,
-					      data->bulk_in),
-			      buffer, bufsize, &actual,
-			      file_data->timeout);
+exit:
+	if (urb)
+		usbtmc_put_urb(file_data, urb);
+	return retval;
+}
 
-	dev_dbg(dev, "%s: bulk_msg retval(%u), actual(%d)\n",
-		__func__, retval, actual);
+/*
+ * Sends a command and a REQUEST_DEV_DEP_MSG_IN without waiting for the
+ * response. Returns the bTag of the request in query.tag to get the
+ * response with USBTMC_IOCTL_QUERY_RESULT.
+ */
+static int usbtmc_ioctl_query_submit(struct usbtmc_file_data *file_data,
+				     void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_pending *entry = NULL;
+	struct usbtmc_query query;
+	ktime_t deadline;
+	int retval;
+	int i;
 
-	/* Store bTag (in case we need to abort) */
-	data->bTag_last_read = data->bTag;
+	/* mutex already locked */
 
-	if (retval < 0) {
-		if (file_data->auto_abort)
-			usbtmc_ioctl_abort_bulk_in(data);
-		goto exit;
-	}
+	if (copy_from_user(&query, arg, sizeof(query)))
+		return -EFAULT;
 
-	/* Sanity checks for the header */
-	if (actual < USBTMC_HEADER_SIZE) {
-		dev_err(dev, "Device sent too small first packet: %u < %u\n",
-			actual, USBTMC_HEADER_SIZE);
-		if (file_data->auto_abort)
-			usbtmc_ioctl_abort_bulk_in(data);
-		goto exit;
-	}
+	if (query.in_size == 0 || query.in_size > USBTMC_MAX_PENDING_SIZE ||
+	    query.out_size > file_data->bufsize - USBTMC_HEADER_SIZE)
+		return -EINVAL;
 
-	if (buffer[0] != 2) {
-		dev_err(dev, "Device sent reply with wrong MsgID: %u != 2\n",
-			buffer[0]);
-		if (file_data->auto_abort)
-			usbtmc_ioctl_abort_bulk_in(data);
-		goto exit;
+	/* responses of other file handles would be mixed up */
+	if (file_data->streaming || file_data->in_urbs_used ||
+	    data->pending_count != file_data->pending_count ||
+	    !usb_anchor_empty(&file_data->in_anchor))
+		return -EBUSY;
+
+	for (i = 0; i < USBTMC_MAX_PENDING; i++) {
+		if (!file_data->pending[i].tag) {
+			entry = &file_data->pending[i];
+			break;
+		}
+	}
+	if (!entry)
+		return -EBUSY;
+
+	deadline = usbtmc_deadline(file_data, 0);
+
+	if (query.out_size) {
+		if (down_timeout(&file_data->limit_write_sem,
+				 usbtmc_timeout_jiffies(file_data,
+							deadline)) < 0)
+			return -ETIMEDOUT;
+		retval = usbtmc_submit_command(file_data, query.out_message,
+					       query.out_size);
+		if (retval < 0) {
+			up(&file_data->limit_write_sem);
+			return retval;
+		}
 	}
 
-	if (buffer[1] != data->bTag_last_write) {
-		dev_err(dev, "Device sent reply with wrong bTag: %u != %u\n",
-		buffer[1], data->bTag_last_write);
-		if (file_data->auto_abort)
-			usbtmc_ioctl_abort_bulk_in(data);
-		goto exit;
+	if (down_timeout(&file_data->limit_write_sem,
+			 usbtmc_timeout_jiffies(file_data, deadline)) < 0) {
+		retval = -ETIMEDOUT;
+		goto error;
+	}
+	retval = usbtmc_submit_request(file_data, query.in_size);
+	if (retval < 0) {
+		up(&file_data->limit_write_sem);
+		goto error;
 	}
 
-	/* How many characters did the instrument send? */
-	n_characters = buffer[4] +
-		       (buffer[5] << 8) +
-		       (buffer[6] << 16) +
-		       (buffer[7] << 24);
+	entry->tag = retval;
+	entry->in_size = query.in_size;
+	file_data->pending_count++;
+	data->pending_count++;
 
-	file_data->bmTransferAttributes = buffer[8];
+	query.tag = entry->tag;
+	query.transferred = 0;
+	if (copy_to_user(arg, &query, sizeof(query)))
+		return -EFAULT;
 
-	dev_dbg(dev, "Bulk-IN header: N_characters(%u), bTransAttr(%u)\n",
-		n_characters, buffer[8]);
+	return 0;
 
-	if (n_characters > remaining) {
-		dev_err(dev, "Device wants to return more data than requested: %u > %zu\n",
-			n_characters, count);
-		if (file_data->auto_abort)
-			usbtmc_ioctl_abort_bulk_in(data);
-		goto exit;
-	}
-#if VERBOSE
-	print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
-			     16, 1, buffer, actual, true);
-#endif
-	remaining = n_characters;
+error:
+	/* the command was sent without request */
+	dev_dbg(&data->intf->dev, "%s: ret=%d\n", __func__, retval);
+	usbtmc_auto_abort_bulk_out(file_data);
+	return retval;
+}
 
-	/* Remove the USBTMC header */
-	actual -= USBTMC_HEADER_SIZE;
+/*
+ * Returns the response of the request with bTag query.tag. Responses of
+ * other requests received meanwhile are kept until they are fetched.
+ */
+static int usbtmc_ioctl_query_result(struct usbtmc_file_data *file_data,
+				     void __user *arg)
+{
+	struct usbtmc_pending *entry = NULL;
+	struct usbtmc_query query;
+	u32 size;
+	int retval;
+	int i;
 
-	/* Remove padding if it exists */
-	if (actual > remaining)
-		actual = remaining;
+	/* mutex already locked */
 
-	remaining -= actual;
+	if (copy_from_user(&query, arg, sizeof(query)))
+		return -EFAULT;
 
-	/* Copy buffer to user space */
-	if (copy_to_user(buf, &buffer[USBTMC_HEADER_SIZE], actual)) {
-		/* There must have been an addressing problem */
-		retval = -EFAULT;
-		goto exit;
+	for (i = 0; i < USBTMC_MAX_PENDING; i++) {
+		if (query.tag && file_data->pending[i].tag == query.tag) {
+			entry = &file_data->pending[i];
+			break;
+		}
 	}
+	if (!entry)
+		return -EINVAL;
 
-	if ((actual + USBTMC_HEADER_SIZE) == bufsize) {
-		retval = usbtmc_generic_read(file_data, buf + actual,
-					     remaining,
-					     &done,
-					     USBTMC_FLAG_IGNORE_TRAILER);
-		if (retval < 0)
-			goto exit;
+	while (!entry->done) {
+		retval = usbtmc_receive_pending(file_data, NULL);
+		if (retval < 0) {
+			usbtmc_fail_pending(file_data, retval);
+			usbtmc_auto_abort_bulk_in(file_data);
+		}
 	}
-	done += actual;
 
-	/* Update file position value */
-	*f_pos = *f_pos + done;
-	retval = done;
+	retval = entry->status;
+	size = min(entry->size, query.in_size);
+	if (!retval && copy_to_user(query.in_message, entry->data, size))
+		retval = -EFAULT;
+
+	query.transferred = retval ? 0 : size;
+	query.bmTransferAttributes = entry->attributes;
+	usbtmc_free_pending(file_data, entry);
+
+	if (copy_to_user(arg, &query, sizeof(query)))
+		return -EFAULT;
 
-exit:
-	mutex_unlock(&data->io_mutex);
-	kfree(buffer);
 	return retval;
 }
 
-static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
-			    size_t count, loff_t *f_pos)
+/*
+ * Reads the response announced by an SRQ with MAV into file_data->prefetch.
+ * The request is skipped if a read() or other Bulk-IN transfer of the file
+ * handle got the response in the meantime.
+ */
+static void usbtmc_prefetch_work(struct work_struct *work)
 {
-	struct usbtmc_file_data *file_data;
-	struct usbtmc_device_data *data;
-	struct urb *urb = NULL;
-	ssize_t retval = 0;
-	u8 *buffer;
-	u32 remaining, done;
-	u32 transfersize, aligned, buflen;
-
-	file_data = filp->private_data;
-	data = file_data->data;
+	struct usbtmc_file_data *file_data =
+		container_of(work, struct usbtmc_file_data, prefetch_work);
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_pending *entry = &file_data->prefetch;
+	int retval;
 
-	mutex_lock(&data->io_mutex);
+	usbtmc_lock(data, USBTMC_LOCK_IN);
+	if (!atomic_xchg(&data->prefetch_srq, 0))
+		goto exit;
 
-	if (data->zombie) {
-		retval = -ENODEV;
+	if (data->zombie || !file_data->prefetch_size || entry->tag ||
+	    file_data->streaming || data->pending_count ||
+	    file_data->in_urbs_used ||
+	    !usb_anchor_empty(&file_data->in_anchor))
 		goto exit;
+
+	usbtmc_lock(data, USBTMC_LOCK_OUT);
+	retval = send_request_dev_dep_msg_in(file_data,
+					     file_data->prefetch_size,
+					     file_data->timeout);
+	entry->tag = data->bTag_last_write;
+	entry->in_size = file_data->prefetch_size;
+	if (retval < 0)
+		usbtmc_auto_abort_bulk_out(file_data);
+	usbtmc_unlock(data, USBTMC_LOCK_OUT);
+
+	if (retval >= 0) {
+		data->bTag_last_read = entry->tag;
+		retval = usbtmc_receive_pending(file_data, entry);
+		if (retval < 0)
+			usbtmc_auto_abort_bulk_in(file_data);
 	}
 
-	done = 0;
+	if (retval == -ETIMEDOUT) {
+		/* the MAV was stale, e.g. the response was read by others */
+		dev_dbg(&data->intf->dev, "%s: bTag=%u discarded\n",
+			__func__, entry->tag);
+		usbtmc_free_prefetch(file_data);
+		goto exit;
+	}
+	if (retval < 0) {
+		/* the error is returned by the next read() */
+		kvfree(entry->data);
+		entry->data = NULL;
+		entry->size = 0;
+		entry->status = retval;
+		entry->done = true;
+	}
+	dev_dbg(&data->intf->dev, "%s: bTag=%u size=%u status=%d\n",
+		__func__, entry->tag, entry->size, entry->status);
 
 	spin_lock_irq(&file_data->err_lock);
-	file_data->out_transfer_size = 0;
-	file_data->out_status = 0;
+	usbtmc_signal_event(file_data, USBTMC_EVENT_IN_READY);
 	spin_unlock_irq(&file_data->err_lock);
+	wake_up_interruptible_poll(&file_data->waitq, EPOLLIN | EPOLLRDNORM);
 
-	if (!count)
-		goto exit;
+exit:
+	usbtmc_unlock(data, USBTMC_LOCK_IN);
+}
 
-	if (down_trylock(&file_data->limit_write_sem)) {
-		/* previous calls were async */
-		retval = -EBUSY;
-		goto exit;
-	}
+/*
+ * Enables the read ahead of responses up to size bytes when an SRQ with
+ * the MAV bit is received. 0 disables the read ahead and discards a
+ * response that is not yet read.
+ */
+static int usbtmc488_ioctl_mav_prefetch(struct usbtmc_file_data *file_data,
+					void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	u32 size;
 
-	urb = usbtmc_create_urb();
-	if (!urb) {
-		retval = -ENOMEM;
-		up(&file_data->limit_write_sem);
-		goto exit;
+	if (get_user(size, (__u32 __user *)arg))
+		return -EFAULT;
+
+	if (size > USBTMC_MAX_PENDING_SIZE)
+		return -EINVAL;
+
+	if (size && !data->iin_ep_present) {
+		dev_dbg(&data->intf->dev, "no interrupt endpoint present\n");
+		return -EFAULT;
 	}
 
-	buffer = urb->transfer_buffer;
-	buflen = urb->transfer_buffer_length;
+	spin_lock_irq(&data->dev_lock);
+	if (size && data->prefetch_file && data->prefetch_file != file_data) {
+		spin_unlock_irq(&data->dev_lock);
+		return -EBUSY;
+	}
+	if (size)
+		data->prefetch_file = file_data;
+	else if (data->prefetch_file == file_data)
+		data->prefetch_file = NULL;
+	WRITE_ONCE(file_data->prefetch_size, size);
+	spin_unlock_irq(&data->dev_lock);
 
-	if (count > INT_MAX) {
-		transfersize = INT_MAX;
-		buffer[8] = 0;
-	} else {
-		transfersize = count;
-		buffer[8] = file_data->eom_val;
+	if (!size) {
+		if (file_data->prefetch.tag)
+			usbtmc_free_prefetch(file_data);
 	}
+	return 0;
+}
 
-	/* Setup IO buffer for DEV_DEP_MSG_OUT message */
-	buffer[0] = 1;
-	buffer[1] = data->bTag;
-	buffer[2] = ~data->bTag;
-	buffer[3] = 0; /* Reserved */
-	buffer[4] = transfersize >> 0;
-	buffer[5] = transfersize >> 8;
-	buffer[6] = transfersize >> 16;
-	buffer[7] = transfersize >> 24;
-	/* buffer[8] is set above... */
-	buffer[9] = 0; /* Reserved */
-	buffer[10] = 0; /* Reserved */
-	buffer[11] = 0; /* Reserved */
+/*
+ * Timer of the periodic query scheduler. The query itself is sent by
+ * usbtmc_periodic_work. A period is lost when the work of the last period
+ * is still pending.
+ */
+static enum hrtimer_restart usbtmc_periodic_timer(struct hrtimer *timer)
+{
+	struct usbtmc_file_data *file_data =
+		container_of(timer, struct usbtmc_file_data, periodic_timer);
+	u64 ticks;
 
-	remaining = transfersize;
+	ticks = hrtimer_forward_now(timer, file_data->periodic_interval);
+	atomic_add(ticks, &file_data->periodic_ticks);
+	queue_work(system_highpri_wq, &file_data->periodic_work);
 
-	if (transfersize + USBTMC_HEADER_SIZE > buflen) {
-		transfersize = buflen - USBTMC_HEADER_SIZE;
-		aligned = buflen;
-	} else {
-		aligned = (transfersize + (USBTMC_HEADER_SIZE + 3)) & ~3;
-	}
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Sends the command and a REQUEST_DEV_DEP_MSG_IN of the periodic query
+ * and stores the response with a time stamp in the sample fifo.
+ */
+static void usbtmc_periodic_work(struct work_struct *work)
+{
+	struct usbtmc_file_data *file_data =
+		container_of(work, struct usbtmc_file_data, periodic_work);
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_sample *sample = file_data->periodic_sample;
+	const u32 in_size = file_data->periodic_in_size;
+	const u32 slot = sizeof(*sample) + in_size;
+	struct usbtmc_pending entry = { };
+	u8 *buffer = file_data->periodic_command;
+	int actual = 0;
+	int retval;
 
-	if (copy_from_user(&buffer[USBTMC_HEADER_SIZE], buf, transfersize)) {
-		retval = -EFAULT;
-		up(&file_data->limit_write_sem);
+	usbtmc_lock(data, USBTMC_LOCK_IN);
+	if (data->zombie || data->suspended || !file_data->periodic)
 		goto exit;
-	}
-
-	dev_dbg(&data->intf->dev, "%s(size:%u align:%u)\n", __func__,
-		(unsigned int)transfersize, (unsigned int)aligned);
-#if VERBOSE
-	print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
-			     16, 1, buffer, aligned, true);
-#endif
-	usb_fill_bulk_urb(urb, data->usb_dev,
-		usb_sndbulkpipe(data->usb_dev, data->bulk_out),
-		urb->transfer_buffer, aligned,
-		usbtmc_write_bulk_cb, file_data);
 
-	usb_anchor_urb(urb, &file_data->submitted);
-	retval = usb_submit_urb(urb, GFP_KERNEL);
-	if (unlikely(retval)) {
-		usb_unanchor_urb(urb);
-		up(&file_data->limit_write_sem);
+	/*
+	 * Bulk-IN data of another request would be taken as response and
+	 * a query would interrupt the query of another client. The period
+	 * is skipped, which shows as gap in seq.
+	 */
+	if (file_data->streaming || data->pending_count ||
+	    atomic_read(&data->response_pending) ||
+	    READ_ONCE(data->recovery.result) == -EINPROGRESS ||
+	    file_data->in_urbs_used || file_data->prefetch.tag ||
+	    !usb_anchor_empty(&file_data->in_anchor)) {
+		spin_lock_irq(&file_data->err_lock);
+		file_data->periodic_busy++;
+		spin_unlock_irq(&file_data->err_lock);
 		goto exit;
 	}
 
-	remaining -= transfersize;
+	memset(sample, 0, slot);
+	sample->seq = atomic_read(&file_data->periodic_ticks);
+	sample->timestamp = ktime_to_ns(ktime_get());
 
+	usbtmc_lock(data, USBTMC_LOCK_OUT);
+	buffer[1] = data->bTag;
+	buffer[2] = ~data->bTag;
+	trace_usbtmc_header_send(&data->intf->dev, file_data, buffer);
+	retval = usb_bulk_msg(data->usb_dev,
+			      usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+			      buffer, file_data->periodic_out_size, &actual,
+			      file_data->timeout);
+	usbtmc_count(file_data, USBTMC_STAT_BYTES_OUT, actual);
 	data->bTag_last_write = data->bTag;
 	data->bTag++;
-
 	if (!data->bTag)
 		data->bTag++;
 
-	/* call generic_write even when remaining = 0 */
-	retval = usbtmc_generic_write(file_data, buf + transfersize, remaining,
-				      &done, USBTMC_FLAG_APPEND);
-	/* truncate alignment bytes */
-	if (done > remaining)
-		done = remaining;
-
-	/*add size of first urb*/
-	done += transfersize;
+	if (retval >= 0) {
+		retval = send_request_dev_dep_msg_in(file_data, in_size,
+						     file_data->timeout);
+		entry.tag = data->bTag_last_write;
+		entry.in_size = in_size;
+	}
+	if (retval < 0)
+		usbtmc_auto_abort_bulk_out(file_data);
+	usbtmc_unlock(data, USBTMC_LOCK_OUT);
+	if (retval < 0)
+		goto store;
 
+	data->bTag_last_read = entry.tag;
+	retval = usbtmc_receive_pending(file_data, &entry);
 	if (retval < 0) {
-		usb_kill_anchored_urbs(&file_data->submitted);
+		usbtmc_auto_abort_bulk_in(file_data);
+		goto store;
+	}
 
-		dev_err(&data->intf->dev,
-			"Unable to send data, error %d\n", (int)retval);
-		if (file_data->auto_abort)
-			usbtmc_ioctl_abort_bulk_out(data);
-		goto exit;
+	sample->size = entry.size;
+	sample->bmTransferAttributes = entry.attributes;
+	memcpy(sample + 1, entry.data, entry.size);
+
+store:
+	kvfree(entry.data);
+	sample->status = retval;
+	if (retval == -ETIMEDOUT)
+		usbtmc_count(file_data, USBTMC_STAT_TIMEOUTS, 1);
+
+	spin_lock_irq(&file_data->err_lock);
+	if (kfifo_avail(&file_data->periodic_fifo) >= slot) {
+		kfifo_in(&file_data->periodic_fifo, sample, slot);
+		file_data->periodic_samples++;
+	} else {
+		file_data->periodic_dropped++;
 	}
+	usbtmc_signal_event(file_data, USBTMC_EVENT_IN_READY);
+	spin_unlock_irq(&file_data->err_lock);
+	wake_up_interruptible_poll(&file_data->waitq, EPOLLIN | EPOLLRDNORM);
 
-	retval = done;
 exit:
-	usb_free_urb(urb);
-	mutex_unlock(&data->io_mutex);
-	return retval;
+	usbtmc_unlock(data, USBTMC_LOCK_IN);
 }
 
-static int usbtmc_ioctl_clear(struct usbtmc_device_data *data)
+/*
+ * Stops the periodic query scheduler. The caller holds in_mutex and
+ * io_mutex, so a queued work finds the scheduler stopped and does not
+ * touch the buffers any more.
+ */
+static void usbtmc_periodic_stop(struct usbtmc_file_data *file_data)
 {
-	struct device *dev;
+	if (!file_data->periodic)
+		return;
+
+	WRITE_ONCE(file_data->periodic, false);
+	hrtimer_cancel(&file_data->periodic_timer);
+	wake_up_interruptible_all(&file_data->waitq);
+
+	kfree(file_data->periodic_command);
+	file_data->periodic_command = NULL;
+	kvfree(file_data->periodic_sample);
+	file_data->periodic_sample = NULL;
+	kvfree(file_data->periodic_buffer);
+	file_data->periodic_buffer = NULL;
+
+	dev_dbg(&file_data->data->intf->dev,
+		"%s: periods=%d dropped=%llu busy=%llu\n",
+		__func__, atomic_read(&file_data->periodic_ticks),
+		file_data->periodic_dropped, file_data->periodic_busy);
+}
+
+/*
+ * Starts the periodic query scheduler: the command is sent every
+ * interval_us and the responses are stored as records of struct
+ * usbtmc_sample and in_size bytes in a fifo of fifo_size bytes.
+ */
+static int usbtmc_ioctl_periodic_start(struct usbtmc_file_data *file_data,
+				       void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_periodic_config config;
+	u32 aligned;
 	u8 *buffer;
-	int rv;
-	int n;
-	int actual = 0;
 
-	dev = &data->intf->dev;
+	/* io_mutex already locked */
+
+	if (copy_from_user(&config, arg, sizeof(config)))
+		return -EFAULT;
+
+	if (config.interval_us < USBTMC_MIN_PERIODIC_INTERVAL ||
+	    config.in_size == 0 || config.out_size == 0 ||
+	    config.out_size > file_data->bufsize - USBTMC_HEADER_SIZE ||
+	    !is_power_of_2(config.fifo_size) ||
+	    config.fifo_size < USBTMC_MIN_STREAM_FIFO ||
+	    config.fifo_size > USBTMC_MAX_STREAM_FIFO ||
+	    config.in_size > config.fifo_size - sizeof(struct usbtmc_sample))
+		return -EINVAL;
 
-	dev_dbg(dev, "Sending INITIATE_CLEAR request\n");
+	if (file_data->periodic)
+		return -EBUSY;
 
-	buffer = kmalloc(USBTMC_BUFSIZE, GFP_KERNEL);
+	aligned = (config.out_size + (USBTMC_HEADER_SIZE + 3)) & ~3;
+	buffer = kzalloc(aligned, GFP_KERNEL);
 	if (!buffer)
 		return -ENOMEM;
+	file_data->periodic_command = buffer;
 
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_INITIATE_CLEAR,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
-			     0, 0, buffer, 1, USB_CTRL_GET_TIMEOUT);
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
+	/* bTag is set by usbtmc_periodic_work */
+	buffer[0] = 1;
+	buffer[4] = config.out_size >> 0;
+	buffer[5] = config.out_size >> 8;
+	buffer[6] = config.out_size >> 16;
+	buffer[7] = config.out_size >> 24;
+	buffer[8] = file_data->eom_val;
+	if (copy_from_user(&buffer[USBTMC_HEADER_SIZE], config.out_message,
+			   config.out_size)) {
+		kfree(buffer);
+		file_data->periodic_command = NULL;
+		return -EFAULT;
 	}
 
-	dev_dbg(dev, "INITIATE_CLEAR returned %x\n", buffer[0]);
-
-	if (buffer[0] != USBTMC_STATUS_SUCCESS) {
-		dev_err(dev, "INITIATE_CLEAR returned %x\n", buffer[0]);
-		rv = -EPERM;
-		goto exit;
+	file_data->periodic_sample =
+		kvmalloc(sizeof(struct usbtmc_sample) + config.in_size,
+			 GFP_KERNEL);
+	file_data->periodic_buffer = kvmalloc(config.fifo_size, GFP_KERNEL);
+	if (!file_data->periodic_sample || !file_data->periodic_buffer) {
+		kfree(file_data->periodic_command);
+		file_data->periodic_command = NULL;
+		kvfree(file_data->periodic_sample);
+		file_data->periodic_sample = NULL;
+		kvfree(file_data->periodic_buffer);
+		file_data->periodic_buffer = NULL;
+		return -ENOMEM;
 	}
+	kfifo_init(&file_data->periodic_fifo, file_data->periodic_buffer,
+		   config.fifo_size);
 
-	n = 0;
+	file_data->periodic_out_size = aligned;
+	file_data->periodic_in_size = config.in_size;
+	file_data->periodic_interval = us_to_ktime(config.interval_us);
+	spin_lock_irq(&file_data->err_lock);
+	file_data->periodic_samples = 0;
+	file_data->periodic_dropped = 0;
+	file_data->periodic_busy = 0;
+	spin_unlock_irq(&file_data->err_lock);
+	atomic_set(&file_data->periodic_ticks, 0);
+	file_data->periodic = true;
 
-usbtmc_clear_check_status:
+	/* first query at once */
+	hrtimer_start(&file_data->periodic_timer, ktime_get(),
+		      HRTIMER_MODE_ABS);
 
-	dev_dbg(dev, "Sending CHECK_CLEAR_STATUS request\n");
+	dev_dbg(&data->intf->dev, "%s: interval=%u us in_size=%u fifo=%u\n",
+		__func__, config.interval_us, config.in_size, config.fifo_size);
+	return 0;
+}
 
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_CHECK_CLEAR_STATUS,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
-			     0, 0, buffer, 2, USB_CTRL_GET_TIMEOUT);
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
-	}
+/*
+ * Reads whole records from the sample fifo. Waits up to the timeout for a
+ * sample unless the flag USBTMC_FLAG_ASYNC is set.
+ */
+static int usbtmc_ioctl_periodic_read(struct usbtmc_file_data *file_data,
+				      void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_message msg;
+	unsigned int copied = 0;
+	u32 slot, len;
+	long rv;
+	int retval = 0;
 
-	dev_dbg(dev, "CHECK_CLEAR_STATUS returned %x\n", buffer[0]);
+	/* io_mutex already locked */
 
-	if (buffer[0] == USBTMC_STATUS_SUCCESS)
-		goto usbtmc_clear_bulk_out_halt;
+	if (copy_from_user(&msg, arg, sizeof(msg)))
+		return -EFAULT;
 
-	if (buffer[0] != USBTMC_STATUS_PENDING) {
-		dev_err(dev, "CHECK_CLEAR_STATUS returned %x\n", buffer[0]);
-		rv = -EPERM;
-		goto exit;
-	}
+	if (!file_data->periodic)
+		return -EINVAL;
 
-	if ((buffer[1] & 1) != 0) {
-		do {
-			dev_dbg(dev, "Reading from bulk in EP\n");
+	slot = sizeof(struct usbtmc_sample) + file_data->periodic_in_size;
+	if (msg.transfer_size < slot)
+		return -EINVAL;
 
-			actual = 0;
-			rv = usb_bulk_msg(data->usb_dev,
-					  usb_rcvbulkpipe(data->usb_dev,
-							  data->bulk_in),
-					  buffer, USBTMC_BUFSIZE,
-					  &actual, USB_CTRL_GET_TIMEOUT);
-#if VERBOSE
-			print_hex_dump_debug("usbtmc ", DUMP_PREFIX_NONE,
-					     16, 1, buffer, actual, true);
-#endif
-			n++;
+	if (!(msg.flags & USBTMC_FLAG_ASYNC)) {
+		/* the work must not wait for io_mutex */
+		usbtmc_unlock(data, USBTMC_LOCK_IO);
+		rv = wait_event_interruptible_timeout(
+			file_data->waitq,
+			!kfifo_is_empty(&file_data->periodic_fifo) ||
+			!READ_ONCE(file_data->periodic) ||
+			READ_ONCE(data->zombie),
+			msecs_to_jiffies(file_data->timeout));
+		usbtmc_lock(data, USBTMC_LOCK_IO);
+
+		if (data->zombie)
+			rv = -ENODEV;
+		else if (!file_data->periodic)
+			rv = -EINVAL;
+		if (rv <= 0) {
+			retval = rv ? rv : -ETIMEDOUT;
+			goto exit;
+		}
 
-			if (rv < 0) {
-				dev_err(dev, "usb_control_msg returned %d\n",
-					rv);
-				goto exit;
-			}
-		} while ((actual == USBTMC_BUFSIZE) &&
-			  (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
-	} else {
-		/* do not stress device with subsequent requests */
-		msleep(50);
-		n++;
+		/* the scheduler may be restarted while io_mutex is unlocked */
+		slot = sizeof(struct usbtmc_sample) +
+		       file_data->periodic_in_size;
+		if (msg.transfer_size < slot) {
+			retval = -EINVAL;
+			goto exit;
+		}
 	}
 
-	if (n >= USBTMC_MAX_READS_TO_CLEAR_BULK_IN) {
-		dev_err(dev, "Couldn't clear device buffer within %d cycles\n",
-			USBTMC_MAX_READS_TO_CLEAR_BULK_IN);
-		rv = -EPERM;
-		goto exit;
-	}
+	/* single reader (io_mutex) and single writer (work) */
+	len = kfifo_len(&file_data->periodic_fifo);
+	len = min(len, msg.transfer_size) / slot * slot;
+	retval = kfifo_to_user(&file_data->periodic_fifo, msg.message,
+			       len, &copied);
+	if (!retval && !copied)
+		retval = -EAGAIN;
 
-	goto usbtmc_clear_check_status;
+exit:
+	if (put_user(copied,
+		     &((struct usbtmc_message __user *)arg)->transferred))
+		return -EFAULT;
 
-usbtmc_clear_bulk_out_halt:
+	return retval;
+}
 
-	rv = usb_clear_halt(data->usb_dev,
-			    usb_sndbulkpipe(data->usb_dev, data->bulk_out));
-	if (rv < 0) {
-		dev_err(dev, "usb_clear_halt returned %d\n", rv);
-		goto exit;
+static int usbtmc_ioctl_periodic_stats(struct usbtmc_file_data *file_data,
+				       void __user *arg)
+{
+	struct usbtmc_periodic_stats stats;
+
+	/* io_mutex already locked */
+
+	memset(&stats, 0, sizeof(stats));
+	spin_lock_irq(&file_data->err_lock);
+	stats.samples = file_data->periodic_samples;
+	stats.dropped = file_data->periodic_dropped;
+	stats.busy = file_data->periodic_busy;
+	stats.periods = atomic_read(&file_data->periodic_ticks);
+	if (file_data->periodic) {
+		stats.fifo_size = kfifo_size(&file_data->periodic_fifo);
+		stats.fifo_level = kfifo_len(&file_data->periodic_fifo);
 	}
-	rv = 0;
+	spin_unlock_irq(&file_data->err_lock);
 
-exit:
-	kfree(buffer);
-	return rv;
+	if (copy_to_user(arg, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
 }
 
 /*
@@ -1835,14 +5169,18 @@ static int usbtmc_ioctl_cancel_io(struct usbtmc_file_data *file_data)
 	file_data->out_status = -ECANCELED;
 	spin_unlock_irq(&file_data->err_lock);
 	usb_kill_anchored_urbs(&file_data->submitted);
+	usb_kill_anchored_urbs(&file_data->in_submitted);
 	return 0;
 }
 
 static int usbtmc_ioctl_cleanup_io(struct usbtmc_file_data *file_data)
 {
 	dev_dbg(&file_data->data->intf->dev, "%s - called: %d\n", __func__, 0);
+	usbtmc_stream_stop(file_data);
+	usbtmc_clear_pending(file_data);
 	usb_kill_anchored_urbs(&file_data->submitted);
-	usb_scuttle_anchored_urbs(&file_data->in_anchor);
+	usb_kill_anchored_urbs(&file_data->in_submitted);
+	usbtmc_recycle_anchored_urbs(file_data, &file_data->in_anchor);
 	spin_lock_irq(&file_data->err_lock);
 	file_data->in_status = 0;
 	file_data->in_transfer_size = 0;
@@ -1924,6 +5262,223 @@ static const struct attribute_group capability_attr_grp = {
 	.attrs = capability_attrs,
 };
 
+static int usbtmc_check_bufsize(u32 bufsize)
+{
+	/* a multiple of 4k is also a multiple of any wMaxPacketSize */
+	if (bufsize < USBTMC_BUFSIZE || bufsize > USBTMC_MAX_BUFSIZE ||
+	    (bufsize % USBTMC_BUFSIZE) != 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+static ssize_t bufsize_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%u\n", data->bufsize);
+}
+
+static ssize_t bufsize_store(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+	u32 bufsize;
+	int rv;
+
+	rv = kstrtou32(buf, 0, &bufsize);
+	if (rv)
+		return rv;
+
+	rv = usbtmc_check_bufsize(bufsize);
+	if (rv)
+		return rv;
+
+	/* only used as default for file handles opened afterwards */
+	data->bufsize = bufsize;
+
+	return count;
+}
+static DEVICE_ATTR_RW(bufsize);
+
+static struct attribute *data_attrs[] = {
+	&dev_attr_bufsize.attr,
+	NULL,
+};
+
+static const struct attribute_group data_attr_grp = {
+	.attrs = data_attrs,
+};
+
+#define stats_attribute(name, stat)					\
+static ssize_t name##_show(struct device *dev,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	struct usb_interface *intf = to_usb_interface(dev);		\
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);	\
+									\
+	return sprintf(buf, "%lld\n",					\
+		       atomic64_read(&data->counters.value[stat]));	\
+}									\
+static DEVICE_ATTR_RO(name)
+
+stats_attribute(bytes_in, USBTMC_STAT_BYTES_IN);
+stats_attribute(bytes_out, USBTMC_STAT_BYTES_OUT);
+stats_attribute(urbs_submitted, USBTMC_STAT_URBS_SUBMITTED);
+stats_attribute(urbs_completed, USBTMC_STAT_URBS_COMPLETED);
+stats_attribute(short_packets, USBTMC_STAT_SHORT_PACKETS);
+stats_attribute(timeouts, USBTMC_STAT_TIMEOUTS);
+stats_attribute(aborts, USBTMC_STAT_ABORTS);
+stats_attribute(srqs, USBTMC_STAT_SRQS);
+stats_attribute(clears, USBTMC_STAT_CLEARS);
+stats_attribute(lock_wait_ns, USBTMC_STAT_LOCK_WAIT_NS);
+stats_attribute(max_urbs_in_flight, USBTMC_STAT_MAX_IN_FLIGHT);
+
+/* writing any value resets the counters of the device */
+static ssize_t reset_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+	int i;
+
+	for (i = 0; i < USBTMC_STATS; i++)
+		atomic64_set(&data->counters.value[i], 0);
+	atomic64_set(&data->counters.value[USBTMC_STAT_MAX_IN_FLIGHT],
+		     max(atomic_read(&data->counters.in_flight), 0));
+
+	return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *stats_attrs[] = {
+	&dev_attr_bytes_in.attr,
+	&dev_attr_bytes_out.attr,
+	&dev_attr_urbs_submitted.attr,
+	&dev_attr_urbs_completed.attr,
+	&dev_attr_short_packets.attr,
+	&dev_attr_timeouts.attr,
+	&dev_attr_aborts.attr,
+	&dev_attr_srqs.attr,
+	&dev_attr_clears.attr,
+	&dev_attr_lock_wait_ns.attr,
+	&dev_attr_max_urbs_in_flight.attr,
+	&dev_attr_reset.attr,
+	NULL,
+};
+
+static const struct attribute_group stats_attr_grp = {
+	.name = "stats",
+	.attrs = stats_attrs,
+};
+
+static const char * const usbtmc_hist_names[USBTMC_HISTS] = {
+	[USBTMC_HIST_OUT] = "out",
+	[USBTMC_HIST_RESPONSE] = "response",
+	[USBTMC_HIST_TRANSFER] = "transfer",
+};
+
+/* percentiles shown for each histogram */
+static const struct {
+	const char *name;
+	unsigned int permille;
+} usbtmc_percentiles[] = {
+	{ "p50", 500 },
+	{ "p99", 990 },
+	{ "p99.9", 999 },
+};
+
+/*
+ * Shows the non-empty buckets of each latency histogram with their upper
+ * limit and the upper limit of the percentiles. The last bucket shows its
+ * lower limit.
+ */
+static int usbtmc_latency_show(struct seq_file *s, void *unused)
+{
+	struct usbtmc_device_data *data = s->private;
+	u64 count[USBTMC_HIST_BUCKETS];
+	u64 total, sum;
+	int h, i, p;
+
+	for (h = 0; h < USBTMC_HISTS; h++) {
+		total = 0;
+		for (i = 0; i < USBTMC_HIST_BUCKETS; i++) {
+			count[i] = atomic64_read(&data->hist[h].bucket[i]);
+			total += count[i];
+		}
+
+		seq_printf(s, "%s: %llu samples\n", usbtmc_hist_names[h],
+			   total);
+		if (!total)
+			continue;
+
+		for (i = 0; i < USBTMC_HIST_BUCKETS - 1; i++) {
+			if (count[i])
+				seq_printf(s, "  < %14llu ns: %llu\n",
+					   1ULL << i, count[i]);
+		}
+		/* the last bucket is open-ended */
+		if (count[i])
+			seq_printf(s, "  >= %13llu ns: %llu\n",
+				   1ULL << (i - 1), count[i]);
+
+		for (p = 0; p < ARRAY_SIZE(usbtmc_percentiles); p++) {
+			sum = 0;
+			for (i = 0; i < USBTMC_HIST_BUCKETS - 1; i++) {
+				sum += count[i];
+				if (sum * 1000 >=
+				    total * usbtmc_percentiles[p].permille)
+					break;
+			}
+			if (i < USBTMC_HIST_BUCKETS - 1)
+				seq_printf(s, "  %-6s < %11llu ns\n",
+					   usbtmc_percentiles[p].name,
+					   1ULL << i);
+			else
+				seq_printf(s, "  %-6s >= %10llu ns\n",
+					   usbtmc_percentiles[p].name,
+					   1ULL << (i - 1));
+		}
+	}
+
+	return 0;
+}
+
+static int usbtmc_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, usbtmc_latency_show, inode->i_private);
+}
+
+/* writing any value resets the histograms */
+static ssize_t usbtmc_latency_write(struct file *file,
+				    const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct usbtmc_device_data *data = s->private;
+	int h, i;
+
+	for (h = 0; h < USBTMC_HISTS; h++)
+		for (i = 0; i < USBTMC_HIST_BUCKETS; i++)
+			atomic64_set(&data->hist[h].bucket[i], 0);
+
+	return count;
+}
+
+static const struct file_operations usbtmc_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= usbtmc_latency_open,
+	.read		= seq_read,
+	.write		= usbtmc_latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 /*
  * Flash activity indicator on device
  */
@@ -2044,13 +5599,48 @@ static int usbtmc_ioctl_set_timeout(struct usbtmc_file_data *file_data,
 	if (get_user(timeout, (__u32 __user *)arg))
 		return -EFAULT;
 
-	/* Note that timeout = 0 means
-	 * MAX_SCHEDULE_TIMEOUT in usb_control_msg
-	 */
-	if (timeout < USBTMC_MIN_TIMEOUT)
+	/* Note that timeout = 0 means
+	 * MAX_SCHEDULE_TIMEOUT in usb_control_msg
+	 */
+	if (timeout < USBTMC_MIN_TIMEOUT)
+		return -EINVAL;
+
+	file_data->timeout = timeout;
+
+	return 0;
+}
+
+/*
+ * Get the whole transfer deadline in ns
+ */
+static int usbtmc_ioctl_get_deadline(struct usbtmc_file_data *file_data,
+				     void __user *arg)
+{
+	u64 deadline;
+
+	deadline = file_data->deadline_ns;
+
+	return put_user(deadline, (__u64 __user *)arg);
+}
+
+/*
+ * Set the whole transfer deadline in ns. A deadline bounds the complete
+ * read, write or query with a single hrtimer instead of restarting
+ * file_data->timeout for each urb. 0 switches back to per urb timeouts.
+ */
+static int usbtmc_ioctl_set_deadline(struct usbtmc_file_data *file_data,
+				     void __user *arg)
+{
+	u64 deadline;
+
+	if (get_user(deadline, (__u64 __user *)arg))
+		return -EFAULT;
+
+	if (deadline && (deadline < USBTMC_MIN_DEADLINE ||
+			 deadline > USBTMC_MAX_DEADLINE))
 		return -EINVAL;
 
-	file_data->timeout = timeout;
+	file_data->deadline_ns = deadline;
 
 	return 0;
 }
@@ -2096,17 +5686,175 @@ static int usbtmc_ioctl_config_termc(struct usbtmc_file_data *file_data,
 	return 0;
 }
 
+/*
+ * Get the size of the urb buffers used for bulk transfers
+ */
+static int usbtmc_ioctl_get_bufsize(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	u32 bufsize;
+
+	bufsize = file_data->bufsize;
+
+	return put_user(bufsize, (__u32 __user *)arg);
+}
+
+/*
+ * Set the size of the urb buffers used for bulk transfers
+ */
+static int usbtmc_ioctl_set_bufsize(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	u32 bufsize;
+	int rv;
+
+	if (get_user(bufsize, (__u32 __user *)arg))
+		return -EFAULT;
+
+	rv = usbtmc_check_bufsize(bufsize);
+	if (rv)
+		return rv;
+
+	/* in_urbs_used and pending urbs depend on the current bufsize */
+	if (file_data->ring_buffer || file_data->streaming ||
+	    file_data->in_urbs_used ||
+	    !usb_anchor_empty(&file_data->submitted) ||
+	    !usb_anchor_empty(&file_data->in_submitted) ||
+	    !usb_anchor_empty(&file_data->in_anchor))
+		return -EBUSY;
+
+	if (bufsize == file_data->bufsize)
+		return 0;
+
+	usbtmc_free_pool(file_data);
+	file_data->bufsize = bufsize;
+
+	return 0;
+}
+
+/*
+ * Registers an eventfd for an event of the file handle or removes it with
+ * fd = -1. The eventfd is signaled directly by the completion handlers.
+ */
+static int usbtmc_ioctl_set_eventfd(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	struct eventfd_ctx *ctx = NULL;
+	struct usbtmc_eventfd efd;
+	struct eventfd_ctx *old;
+
+	if (copy_from_user(&efd, arg, sizeof(efd)))
+		return -EFAULT;
+
+	if (efd.event >= USBTMC_EVENTFDS)
+		return -EINVAL;
+
+	if (efd.fd >= 0) {
+		ctx = eventfd_ctx_fdget(efd.fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	spin_lock_irq(&file_data->err_lock);
+	old = file_data->eventfd[efd.event];
+	file_data->eventfd[efd.event] = ctx;
+	spin_unlock_irq(&file_data->err_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+/*
+ * Returns the locks needed by an ioctl. Bulk-IN and Bulk-OUT transfers
+ * only exclude each other when they share state of the file handle, thus
+ * a reader thread can wait for a response while another thread sends the
+ * next command or an abort request.
+ */
+static unsigned int usbtmc_ioctl_locks(unsigned int cmd)
+{
+	switch (cmd) {
+	case USBTMC_IOCTL_READ:
+	case USBTMC_IOCTL_RING_READ:
+	case USBTMC_IOCTL_RING_RELEASE:
+	case USBTMC_IOCTL_QUERY_RESULT:
+	case USBTMC_IOCTL_STREAM_START:
+	case USBTMC_IOCTL_STREAM_STOP:
+	case USBTMC_IOCTL_STREAM_READ:
+	case USBTMC_IOCTL_STREAM_STATS:
+	case USBTMC488_IOCTL_MAV_PREFETCH:
+		return USBTMC_LOCK_IN;
+
+	case USBTMC_IOCTL_WRITE:
+	case USBTMC_IOCTL_WRITE_RESULT:
+	case USBTMC488_IOCTL_TRIGGER:
+		return USBTMC_LOCK_OUT;
+
+	case USBTMC_IOCTL_QUERY:
+	case USBTMC_IOCTL_BATCH:
+	case USBTMC_IOCTL_QUERY_SUBMIT:
+	case USBTMC_IOCTL_SET_BUFSIZE:
+	case USBTMC_IOCTL_RING_ALLOC:
+	case USBTMC_IOCTL_CLEANUP_IO:
+		return USBTMC_LOCK_IN | USBTMC_LOCK_OUT;
+
+	/* long running sequences of control and bulk transfers */
+	case USBTMC_IOCTL_CLEAR:
+	case USBTMC_IOCTL_ABORT_BULK_OUT:
+	case USBTMC_IOCTL_ABORT_BULK_OUT_TAG:
+	case USBTMC_IOCTL_ABORT_BULK_IN:
+	case USBTMC_IOCTL_ABORT_BULK_IN_TAG:
+	case USBTMC_IOCTL_RECOVERY_START:
+		return USBTMC_LOCK_ABORT;
+
+	/* takes ctrl_mutex itself, if no SRQ is pending */
+	case USBTMC488_IOCTL_READ_STB:
+	/* only protected by dev_lock */
+	case USBTMC488_IOCTL_READ_SRQ_EVENTS:
+	/* atomic counters */
+	case USBTMC_IOCTL_GET_STATS:
+	/* waits for the work of USBTMC_IOCTL_RECOVERY_START */
+	case USBTMC_IOCTL_RECOVERY_RESULT:
+		return 0;
+
+	case USBTMC_IOCTL_CLEAR_OUT_HALT:
+	case USBTMC_IOCTL_CLEAR_IN_HALT:
+	case USBTMC_IOCTL_SET_OUT_HALT:
+	case USBTMC_IOCTL_SET_IN_HALT:
+	case USBTMC_IOCTL_INDICATOR_PULSE:
+	case USBTMC_IOCTL_CTRL_REQUEST:
+	case USBTMC488_IOCTL_REN_CONTROL:
+	case USBTMC488_IOCTL_GOTO_LOCAL:
+	case USBTMC488_IOCTL_LOCAL_LOCKOUT:
+		return USBTMC_LOCK_CTRL;
+
+	/* the work takes in_mutex, the reader io_mutex */
+	case USBTMC_IOCTL_PERIODIC_START:
+	case USBTMC_IOCTL_PERIODIC_STOP:
+		return USBTMC_LOCK_IN | USBTMC_LOCK_IO;
+
+	default:
+		/*
+		 * settings, USBTMC488_IOCTL_WAIT_SRQ, USBTMC_IOCTL_CANCEL_IO,
+		 * USBTMC_IOCTL_PERIODIC_READ and USBTMC_IOCTL_PERIODIC_STATS
+		 */
+		return USBTMC_LOCK_IO;
+	}
+}
+
 static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct usbtmc_file_data *file_data;
 	struct usbtmc_device_data *data;
+	unsigned int locks = usbtmc_ioctl_locks(cmd);
 	int retval = -EBADRQC;
 	__u8 tmp_byte;
 
 	file_data = file->private_data;
 	data = file_data->data;
 
-	mutex_lock(&data->io_mutex);
+	usbtmc_lock(data, locks);
 	if (data->zombie) {
 		retval = -ENODEV;
 		goto skip_io_on_zombie;
@@ -2153,6 +5901,41 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		retval = usbtmc_ioctl_abort_bulk_in_tag(data, tmp_byte);
 		break;
 
+	case USBTMC488_IOCTL_MAV_PREFETCH:
+		retval = usbtmc488_ioctl_mav_prefetch(file_data,
+						      (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_PERIODIC_START:
+		retval = usbtmc_ioctl_periodic_start(file_data,
+						     (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_PERIODIC_STOP:
+		usbtmc_periodic_stop(file_data);
+		retval = 0;
+		break;
+
+	case USBTMC_IOCTL_PERIODIC_READ:
+		retval = usbtmc_ioctl_periodic_read(file_data,
+						    (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_PERIODIC_STATS:
+		retval = usbtmc_ioctl_periodic_stats(file_data,
+						     (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_RECOVERY_START:
+		retval = usbtmc_ioctl_recovery_start(file_data,
+						     (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_RECOVERY_RESULT:
+		retval = usbtmc_ioctl_recovery_result(file_data,
+						      (void __user *)arg);
+		break;
+
 	case USBTMC_IOCTL_CTRL_REQUEST:
 		retval = usbtmc_ioctl_request(data, (void __user *)arg);
 		break;
@@ -2167,6 +5950,16 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 						  (void __user *)arg);
 		break;
 
+	case USBTMC_IOCTL_GET_DEADLINE:
+		retval = usbtmc_ioctl_get_deadline(file_data,
+						   (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_SET_DEADLINE:
+		retval = usbtmc_ioctl_set_deadline(file_data,
+						   (void __user *)arg);
+		break;
+
 	case USBTMC_IOCTL_EOM_ENABLE:
 		retval = usbtmc_ioctl_eom_enable(file_data,
 						 (void __user *)arg);
@@ -2177,6 +5970,69 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 						   (void __user *)arg);
 		break;
 
+	case USBTMC_IOCTL_GET_BUFSIZE:
+		retval = usbtmc_ioctl_get_bufsize(file_data,
+						  (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_SET_BUFSIZE:
+		retval = usbtmc_ioctl_set_bufsize(file_data,
+						  (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_RING_ALLOC:
+		retval = usbtmc_ioctl_ring_alloc(file_data,
+						 (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_RING_READ:
+		retval = usbtmc_ioctl_ring_read(file_data,
+						(void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_RING_RELEASE:
+		retval = usbtmc_ioctl_ring_release(file_data,
+						   (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_QUERY:
+		retval = usbtmc_ioctl_query(file_data, (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_BATCH:
+		retval = usbtmc_ioctl_batch(file_data, (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_QUERY_SUBMIT:
+		retval = usbtmc_ioctl_query_submit(file_data,
+						   (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_QUERY_RESULT:
+		retval = usbtmc_ioctl_query_result(file_data,
+						   (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_STREAM_START:
+		retval = usbtmc_ioctl_stream_start(file_data,
+						   (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_STREAM_STOP:
+		usbtmc_stream_stop(file_data);
+		retval = 0;
+		break;
+
+	case USBTMC_IOCTL_STREAM_READ:
+		retval = usbtmc_ioctl_stream_read(file_data,
+						  (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_STREAM_STATS:
+		retval = usbtmc_ioctl_stream_stats(file_data,
+						   (void __user *)arg);
+		break;
+
 	case USBTMC_IOCTL_WRITE:
 		retval = usbtmc_ioctl_generic_write(file_data,
 						    (void __user *)arg);
@@ -2226,6 +6082,16 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		retval = usbtmc488_ioctl_trigger(file_data);
 		break;
 
+	case USBTMC488_IOCTL_READ_SRQ_EVENTS:
+		retval = usbtmc488_ioctl_read_srq_events(file_data,
+							 (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_SET_EVENTFD:
+		retval = usbtmc_ioctl_set_eventfd(file_data,
+						  (void __user *)arg);
+		break;
+
 	case USBTMC488_IOCTL_WAIT_SRQ:
 		retval = usbtmc488_ioctl_wait_srq(file_data,
 						  (__u32 __user *)arg);
@@ -2236,6 +6102,16 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				  (__u8 __user *)arg);
 		break;
 
+	case USBTMC_IOCTL_MSG_IN_TIME:
+		retval = usbtmc_ioctl_msg_in_time(file_data,
+						  (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_GET_STATS:
+		retval = usbtmc_ioctl_get_stats(file_data,
+						(void __user *)arg);
+		break;
+
 	case USBTMC_IOCTL_AUTO_ABORT:
 		retval = get_user(tmp_byte, (unsigned char __user *)arg);
 		if (retval == 0)
@@ -2259,11 +6135,95 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	}
 
+	if (cmd == USBTMC_IOCTL_CLEAR)
+		usbtmc_count(file_data, USBTMC_STAT_CLEARS, 1);
+	else if (locks == USBTMC_LOCK_ABORT &&
+		 cmd != USBTMC_IOCTL_RECOVERY_START)
+		usbtmc_count(file_data, USBTMC_STAT_ABORTS, 1);
+	if (retval == -ETIMEDOUT)
+		usbtmc_count(file_data, USBTMC_STAT_TIMEOUTS, 1);
+
 skip_io_on_zombie:
-	mutex_unlock(&data->io_mutex);
+	usbtmc_unlock(data, locks);
 	return retval;
 }
 
+/*
+ * io_uring passthrough of USBTMC_IOCTL_READ, USBTMC_IOCTL_WRITE and
+ * USBTMC_IOCTL_QUERY. The command area of the SQE holds a pointer to the
+ * ioctl argument. All operations may block, so they are executed by the
+ * io-wq worker threads. The CQE returns the number of transferred bytes
+ * or an error code. With IORING_SETUP_CQE32 the extra result returns
+ * the transferred bytes (bits 0..31) and bmTransferAttributes
+ * (bits 32..39) of a query.
+ */
+static int usbtmc_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	struct usbtmc_file_data *file_data = cmd->file->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	const struct usbtmc_uring_cmd *ucmd = io_uring_sqe_cmd(cmd->sqe);
+	void __user *arg = u64_to_user_ptr(READ_ONCE(ucmd->arg));
+	struct usbtmc_query query;
+	u32 transferred = 0;
+	u8 attributes = 0;
+	unsigned int locks;
+	int retval;
+
+	if (issue_flags & IO_URING_F_NONBLOCK)
+		return -EAGAIN;
+
+	locks = usbtmc_ioctl_locks(cmd->cmd_op);
+	usbtmc_lock(data, locks);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto skip_io_on_zombie;
+	}
+
+	switch (cmd->cmd_op) {
+	case USBTMC_IOCTL_READ:
+	case USBTMC_IOCTL_WRITE:
+		if (cmd->cmd_op == USBTMC_IOCTL_READ)
+			retval = usbtmc_ioctl_generic_read(file_data, arg);
+		else
+			retval = usbtmc_ioctl_generic_write(file_data, arg);
+		if (get_user(transferred,
+			     &((struct usbtmc_message __user *)arg)->transferred))
+			retval = -EFAULT;
+		break;
+
+	case USBTMC_IOCTL_QUERY:
+		if (copy_from_user(&query, arg, sizeof(query))) {
+			retval = -EFAULT;
+			break;
+		}
+		retval = usbtmc_query(file_data, &query,
+				      usbtmc_deadline(file_data, 0));
+		transferred = query.transferred;
+		attributes = query.bmTransferAttributes;
+		if (copy_to_user(arg, &query, sizeof(query)))
+			retval = -EFAULT;
+		break;
+
+	default:
+		retval = -EBADRQC;
+		break;
+	}
+
+	if (retval == -ETIMEDOUT)
+		usbtmc_count(file_data, USBTMC_STAT_TIMEOUTS, 1);
+
+skip_io_on_zombie:
+	usbtmc_unlock(data, locks);
+
+	/* positive return values of generic_read only signal a short packet */
+	if (retval >= 0)
+		retval = min_t(u32, transferred, INT_MAX);
+
+	io_uring_cmd_done(cmd, retval, ((u64)attributes << 32) | transferred,
+			  issue_flags);
+	return -EIOCBQUEUED;
+}
+
 static int usbtmc_fasync(int fd, struct file *file, int on)
 {
 	struct usbtmc_file_data *file_data = file->private_data;
@@ -2271,53 +6231,112 @@ static int usbtmc_fasync(int fd, struct file *file, int on)
 	return fasync_helper(fd, file, on, &file_data->data->fasync);
 }
 
-static unsigned int usbtmc_poll(struct file *file, poll_table *wait)
+/*
+ * Computes the poll mask without taking any mutex, so poll() and epoll
+ * never wait for a running transfer. Every transition to a ready state
+ * wakes up the waitq of the file handle with the matching poll key, thus
+ * EPOLLET is supported.
+ */
+static __poll_t usbtmc_poll(struct file *file, poll_table *wait)
 {
 	struct usbtmc_file_data *file_data = file->private_data;
 	struct usbtmc_device_data *data = file_data->data;
-	unsigned int mask;
-
-	mutex_lock(&data->io_mutex);
+	__poll_t mask = 0;
 
-	if (data->zombie) {
-		mask = POLLHUP | POLLERR;
-		goto no_poll;
-	}
+	poll_wait(file, &file_data->waitq, wait);
 
-	poll_wait(file, &data->waitq, wait);
+	/* zombie is set before usbtmc_disconnect wakes up all waiters */
+	if (READ_ONCE(data->zombie))
+		return EPOLLHUP | EPOLLERR;
 
-	/* Note that POLLPRI is now assigned to SRQ, and
-	 * POLLIN|POLLRDNORM to normal read data.
+	/* Note that EPOLLPRI is now assigned to SRQ, and
+	 * EPOLLIN|EPOLLRDNORM to normal read data.
 	 */
-	mask = 0;
 	if (atomic_read(&file_data->srq_asserted))
-		mask |= POLLPRI;
+		mask |= EPOLLPRI;
 
-	/* Note that the anchor submitted includes all urbs for BULK IN
-	 * and OUT. So POLLOUT is signaled when BULK OUT is empty and
-	 * all BULK IN urbs are completed and moved to in_anchor.
+	/* EPOLLOUT is signaled when BULK OUT is empty and all BULK IN
+	 * urbs are completed and moved to in_anchor.
 	 */
-	if (usb_anchor_empty(&file_data->submitted))
-		mask |= (POLLOUT | POLLWRNORM);
-	if (!usb_anchor_empty(&file_data->in_anchor))
-		mask |= (POLLIN | POLLRDNORM);
+	if (usb_anchor_empty(&file_data->submitted) &&
+	    usb_anchor_empty(&file_data->in_submitted))
+		mask |= (EPOLLOUT | EPOLLWRNORM);
+	if (!usb_anchor_empty(&file_data->in_anchor) ||
+	    READ_ONCE(file_data->prefetch.done))
+		mask |= (EPOLLIN | EPOLLRDNORM);
 
 	spin_lock_irq(&file_data->err_lock);
-	if (file_data->in_status || file_data->out_status)
-		mask |= POLLERR;
+	if (READ_ONCE(file_data->streaming) &&
+	    !kfifo_is_empty(&file_data->stream_fifo))
+		mask |= (EPOLLIN | EPOLLRDNORM);
+	if (READ_ONCE(file_data->periodic) &&
+	    !kfifo_is_empty(&file_data->periodic_fifo))
+		mask |= (EPOLLIN | EPOLLRDNORM);
+	if (file_data->in_status || file_data->out_status ||
+	    file_data->stream_status)
+		mask |= EPOLLERR;
 	spin_unlock_irq(&file_data->err_lock);
 
 	dev_dbg(&data->intf->dev, "poll mask = %x\n", mask);
 
-no_poll:
-	mutex_unlock(&data->io_mutex);
 	return mask;
 }
 
+/*
+ * Maps the ring buffers allocated with USBTMC_IOCTL_RING_ALLOC read-only
+ * to user space. Buffer n starts at offset n * buffer_size.
+ */
+static int usbtmc_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct usbtmc_file_data *file_data = file->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	size_t size = vma->vm_end - vma->vm_start;
+	struct usb_hcd *hcd;
+	int retval;
+
+	/* the ring is allocated with in_mutex locked */
+	mutex_lock(&data->in_mutex);
+
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	if (!file_data->ring_buffer || vma->vm_pgoff ||
+	    size > PAGE_ALIGN(file_data->ring_size * file_data->bufsize)) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	/* buffers are also used for bulk out transfers */
+	if (vma->vm_flags & VM_WRITE) {
+		retval = -EPERM;
+		goto exit;
+	}
+	vm_flags_clear(vma, VM_MAYWRITE);
+	vm_flags_set(vma, VM_IO | VM_DONTEXPAND | VM_DONTDUMP);
+
+	/* Note: the ring lives until the file is released */
+	hcd = bus_to_hcd(data->usb_dev->bus);
+	if (hcd->localmem_pool || !hcd_uses_dma(hcd))
+		retval = remap_pfn_range(vma, vma->vm_start,
+				virt_to_phys(file_data->ring_buffer) >> PAGE_SHIFT,
+				size, vma->vm_page_prot);
+	else
+		retval = dma_mmap_coherent(hcd->self.sysdev, vma,
+					   file_data->ring_buffer,
+					   file_data->ring_dma, size);
+
+exit:
+	mutex_unlock(&data->in_mutex);
+	return retval;
+}
+
 static const struct file_operations fops = {
 	.owner		= THIS_MODULE,
-	.read		= usbtmc_read,
-	.write		= usbtmc_write,
+	.read_iter	= usbtmc_read_iter,
+	.write_iter	= usbtmc_write_iter,
+	.splice_read	= copy_splice_read,
 	.open		= usbtmc_open,
 	.release	= usbtmc_release,
 	.flush		= usbtmc_flush,
@@ -2327,6 +6346,8 @@ static const struct file_operations fops = {
 #endif
 	.fasync         = usbtmc_fasync,
 	.poll           = usbtmc_poll,
+	.mmap		= usbtmc_mmap,
+	.uring_cmd	= usbtmc_uring_cmd,
 	.llseek		= default_llseek,
 };
 
@@ -2358,9 +6379,16 @@ static void usbtmc_interrupt(struct urb *urb)
 		}
 		/* check for SRQ notification */
 		if (data->iin_buffer[0] == 0x81) {
+			struct usbtmc_srq_event event = {
+				.timestamp = ktime_to_ns(ktime_get()),
+				.stb = data->iin_buffer[1],
+			};
 			unsigned long flags;
 			struct list_head *elem;
 
+			trace_usbtmc_srq(dev, data->iin_buffer[0],
+					 data->iin_buffer[1]);
+			atomic64_inc(&data->counters.value[USBTMC_STAT_SRQS]);
 			if (data->fasync)
 				kill_fasync(&data->fasync,
 					SIGIO, POLL_PRI);
@@ -2372,15 +6400,27 @@ static void usbtmc_interrupt(struct urb *urb)
 				file_data = list_entry(elem,
 						       struct usbtmc_file_data,
 						       file_elem);
-				file_data->srq_byte = data->iin_buffer[1];
+				if (!kfifo_put(&file_data->srq_fifo, event))
+					file_data->srq_lost++;
+				atomic64_inc(&file_data->counters.value[USBTMC_STAT_SRQS]);
 				atomic_set(&file_data->srq_asserted, 1);
+				spin_lock(&file_data->err_lock);
+				usbtmc_signal_event(file_data, USBTMC_EVENT_SRQ);
+				spin_unlock(&file_data->err_lock);
+				wake_up_interruptible_poll(&file_data->waitq,
+							   EPOLLPRI);
+			}
+			if ((event.stb & USBTMC488_STB_MAV) &&
+			    data->prefetch_file) {
+				atomic_set(&data->prefetch_srq, 1);
+				queue_work(system_highpri_wq,
+					   &data->prefetch_file->prefetch_work);
 			}
 			spin_unlock_irqrestore(&data->dev_lock, flags);
 
 			dev_dbg(dev, "srq received bTag %x stb %x\n",
 				(unsigned int)data->iin_buffer[0],
 				(unsigned int)data->iin_buffer[1]);
-			wake_up_interruptible_all(&data->waitq);
 			goto exit;
 		}
 		dev_warn(dev, "invalid notification: %x\n",
@@ -2438,18 +6478,33 @@ static int usbtmc_probe(struct usb_interface *intf,
 	if (!data)
 		return -ENOMEM;
 
+	data->iocb_wq = alloc_ordered_workqueue("usbtmc-%s", 0,
+						dev_name(&intf->dev));
+	if (!data->iocb_wq) {
+		kfree(data);
+		return -ENOMEM;
+	}
+
 	data->intf = intf;
 	data->id = id;
 	data->usb_dev = usb_get_dev(interface_to_usbdev(intf));
 	usb_set_intfdata(intf, data);
 	kref_init(&data->kref);
+	mutex_init(&data->in_mutex);
+	mutex_init(&data->out_mutex);
+	mutex_init(&data->abort_mutex);
+	mutex_init(&data->ctrl_mutex);
 	mutex_init(&data->io_mutex);
 	init_waitqueue_head(&data->waitq);
+	INIT_DELAYED_WORK(&data->recovery.work, usbtmc_recovery_work);
+	init_waitqueue_head(&data->recovery.wait);
+	data->recovery.result = -ENODATA; /* no sequence started */
 	atomic_set(&data->iin_data_valid, 0);
 	INIT_LIST_HEAD(&data->file_list);
 	spin_lock_init(&data->dev_lock);
 
 	data->zombie = 0;
+	data->bufsize = USBTMC_BUFSIZE;
 
 	/* Initialize USBTMC bTag and other fields */
 	data->bTag	= 1;
@@ -2506,6 +6561,19 @@ static int usbtmc_probe(struct usb_interface *intf,
 		retcode = sysfs_create_group(&intf->dev.kobj,
 					     &capability_attr_grp);
 
+	retcode = sysfs_create_group(&intf->dev.kobj, &data_attr_grp);
+	if (!retcode)
+		retcode = sysfs_create_group(&intf->dev.kobj, &stats_attr_grp);
+	if (retcode) {
+		dev_err(&intf->dev, "can't create sysfs attributes\n");
+		goto error_register;
+	}
+
+	data->debugfs_dir = debugfs_create_dir(dev_name(&intf->dev),
+					       usbtmc_debugfs_root);
+	debugfs_create_file("latency", 0600, data->debugfs_dir, data,
+			    &usbtmc_latency_fops);
+
 	if (data->iin_ep_present) {
 		/* allocate int urb */
 		data->iin_urb = usb_alloc_urb(0, GFP_KERNEL);
@@ -2552,6 +6620,9 @@ static int usbtmc_probe(struct usb_interface *intf,
 
 error_register:
 	sysfs_remove_group(&intf->dev.kobj, &capability_attr_grp);
+	sysfs_remove_group(&intf->dev.kobj, &data_attr_grp);
+	sysfs_remove_group(&intf->dev.kobj, &stats_attr_grp);
+	debugfs_remove_recursive(data->debugfs_dir);
 	usbtmc_free_int(data);
 	kref_put(&data->kref, usbtmc_delete);
 	return retcode;
@@ -2566,7 +6637,10 @@ static void usbtmc_disconnect(struct usb_interface *intf)
 
 	usb_deregister_dev(intf, &usbtmc_class);
 	sysfs_remove_group(&intf->dev.kobj, &capability_attr_grp);
-	mutex_lock(&data->io_mutex);
+	sysfs_remove_group(&intf->dev.kobj, &data_attr_grp);
+	sysfs_remove_group(&intf->dev.kobj, &stats_attr_grp);
+	debugfs_remove_recursive(data->debugfs_dir);
+	usbtmc_lock(data, USBTMC_LOCK_ALL);
 	data->zombie = 1;
 	wake_up_interruptible_all(&data->waitq);
 	list_for_each(elem, &data->file_list) {
@@ -2575,10 +6649,24 @@ static void usbtmc_disconnect(struct usb_interface *intf)
 		file_data = list_entry(elem,
 				       struct usbtmc_file_data,
 				       file_elem);
+		wake_up_interruptible_all(&file_data->waitq);
+		/* a queued periodic work finds the zombie and ends */
+		hrtimer_cancel(&file_data->periodic_timer);
+		usbtmc_stream_stop(file_data);
 		usb_kill_anchored_urbs(&file_data->submitted);
-		usb_scuttle_anchored_urbs(&file_data->in_anchor);
+		usb_kill_anchored_urbs(&file_data->in_submitted);
+		usbtmc_recycle_anchored_urbs(file_data,
+					     &file_data->in_anchor);
 	}
-	mutex_unlock(&data->io_mutex);
+	usbtmc_unlock(data, USBTMC_LOCK_ALL);
+	/*
+	 * The work queues itself again for each step of the sequence and
+	 * fails to do so while it is canceled. A sequence that is not
+	 * finished afterwards is ended here.
+	 */
+	cancel_delayed_work_sync(&data->recovery.work);
+	if (READ_ONCE(data->recovery.result) == -EINPROGRESS)
+		usbtmc_recovery_end(data, &data->recovery, -ENODEV);
 	usbtmc_free_int(data);
 	kref_put(&data->kref, usbtmc_delete);
 }
@@ -2587,10 +6675,13 @@ static void usbtmc_draw_down(struct usbtmc_file_data *file_data)
 {
 	int time;
 
+	usbtmc_stream_stop(file_data);
+	usbtmc_clear_pending(file_data);
 	time = usb_wait_anchor_empty_timeout(&file_data->submitted, 1000);
 	if (!time)
 		usb_kill_anchored_urbs(&file_data->submitted);
-	usb_scuttle_anchored_urbs(&file_data->in_anchor);
+	usb_kill_anchored_urbs(&file_data->in_submitted);
+	usbtmc_recycle_anchored_urbs(file_data, &file_data->in_anchor);
 }
 
 static int usbtmc_suspend(struct usb_interface *intf, pm_message_t message)
@@ -2603,29 +6694,51 @@ static int usbtmc_suspend(struct usb_interface *intf, pm_message_t message)
 	if (!data)
 		return 0;
 
-	mutex_lock(&data->io_mutex);
+	usbtmc_lock(data, USBTMC_LOCK_ALL);
+	/* a queued periodic work finds the device suspended and ends */
+	data->suspended = true;
 	list_for_each(elem, &data->file_list) {
 		struct usbtmc_file_data *file_data;
 
 		file_data = list_entry(elem,
 				       struct usbtmc_file_data,
 				       file_elem);
+		hrtimer_cancel(&file_data->periodic_timer);
 		usbtmc_draw_down(file_data);
 	}
 
 	if (data->iin_ep_present && data->iin_urb)
 		usb_kill_urb(data->iin_urb);
 
-	mutex_unlock(&data->io_mutex);
+	usbtmc_unlock(data, USBTMC_LOCK_ALL);
 	return 0;
 }
 
 static int usbtmc_resume(struct usb_interface *intf)
 {
 	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+	struct list_head *elem;
 	int retcode = 0;
 
 	dev_dbg(&intf->dev, "%s - called\n", __func__);
+
+	/* restart the periodic queries with the next period */
+	usbtmc_lock(data, USBTMC_LOCK_IN | USBTMC_LOCK_IO);
+	data->suspended = false;
+	list_for_each(elem, &data->file_list) {
+		struct usbtmc_file_data *file_data;
+
+		file_data = list_entry(elem,
+				       struct usbtmc_file_data,
+				       file_elem);
+		if (file_data->periodic)
+			hrtimer_start(&file_data->periodic_timer,
+				      ktime_add(ktime_get(),
+						file_data->periodic_interval),
+				      HRTIMER_MODE_ABS);
+	}
+	usbtmc_unlock(data, USBTMC_LOCK_IN | USBTMC_LOCK_IO);
+
 	if (data->iin_ep_present && data->iin_urb)
 		retcode = usb_submit_urb(data->iin_urb, GFP_KERNEL);
 	if (retcode)
@@ -2642,7 +6755,7 @@ static int usbtmc_pre_reset(struct usb_interface *intf)
 	if (!data)
 		return 0;
 
-	mutex_lock(&data->io_mutex);
+	usbtmc_lock(data, USBTMC_LOCK_ALL);
 
 	list_for_each(elem, &data->file_list) {
 		struct usbtmc_file_data *file_data;
@@ -2660,7 +6773,7 @@ static int usbtmc_post_reset(struct usb_interface *intf)
 {
 	struct usbtmc_device_data *data  = usb_get_intfdata(intf);
 
-	mutex_unlock(&data->io_mutex);
+	usbtmc_unlock(data, USBTMC_LOCK_ALL);
 
 	return 0;
 }
@@ -2676,6 +6789,25 @@ static struct usb_driver usbtmc_driver = {
 	.post_reset	= usbtmc_post_reset,
 };
 
-module_usb_driver(usbtmc_driver);
+static int __init usbtmc_init(void)
+{
+	int retval;
+
+	usbtmc_debugfs_root = debugfs_create_dir("usbtmc", NULL);
+
+	retval = usb_register(&usbtmc_driver);
+	if (retval)
+		debugfs_remove(usbtmc_debugfs_root);
+
+	return retval;
+}
+module_init(usbtmc_init);
+
+static void __exit usbtmc_exit(void)
+{
+	usb_deregister(&usbtmc_driver);
+	debugfs_remove(usbtmc_debugfs_root);
+}
+module_exit(usbtmc_exit);
 
 MODULE_LICENSE("GPL");
@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * usbtmc_trace.h - tracepoints of the USB Test & Measurement class driver
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM usbtmc
+
+#if !defined(__USBTMC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __USBTMC_TRACE_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+#include <linux/unaligned.h>
+
+/* bulk urbs of a file handle */
+DECLARE_EVENT_CLASS(usbtmc_log_urb,
+	TP_PROTO(struct device *dev, const void *file, struct urb *urb),
+	TP_ARGS(dev, file, urb),
+	TP_STRUCT__entry(
+		__string(name, dev_name(dev))
+		__field(const void *, file)
+		__field(const void *, urb)
+		__field(bool, in)
+		__field(u32, length)
+		__field(u32, actual)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__assign_str(name);
+		__entry->file = file;
+		__entry->urb = urb;
+		__entry->in = usb_urb_dir_in(urb);
+		__entry->length = urb->transfer_buffer_length;
+		__entry->actual = urb->actual_length;
+		__entry->status = urb->status;
+	),
+	TP_printk("%s: file %p urb %p %s length %u actual %u status %d",
+		  __get_str(name), __entry->file, __entry->urb,
+		  __entry->in ? "in" : "out", __entry->length,
+		  __entry->actual, __entry->status)
+);
+
+DEFINE_EVENT(usbtmc_log_urb, usbtmc_urb_submit,
+	TP_PROTO(struct device *dev, const void *file, struct urb *urb),
+	TP_ARGS(dev, file, urb)
+);
+
+DEFINE_EVENT(usbtmc_log_urb, usbtmc_urb_complete,
+	TP_PROTO(struct device *dev, const void *file, struct urb *urb),
+	TP_ARGS(dev, file, urb)
+);
+
+/* USBTMC bulk message headers, see USBTMC specification, Table 1 */
+DECLARE_EVENT_CLASS(usbtmc_log_header,
+	TP_PROTO(struct device *dev, const void *file, const u8 *header),
+	TP_ARGS(dev, file, header),
+	TP_STRUCT__entry(
+		__string(name, dev_name(dev))
+		__field(const void *, file)
+		__field(u8, msg_id)
+		__field(u8, tag)
+		__field(u32, size)
+		__field(u8, attributes)
+	),
+	TP_fast_assign(
+		__assign_str(name);
+		__entry->file = file;
+		__entry->msg_id = header[0];
+		__entry->tag = header[1];
+		__entry->size = get_unaligned_le32(&header[4]);
+		__entry->attributes = header[8];
+	),
+	TP_printk("%s: file %p MsgID %u bTag %u size %u attributes 0x%02x",
+		  __get_str(name), __entry->file, __entry->msg_id,
+		  __entry->tag, __entry->size, __entry->attributes)
+);
+
+DEFINE_EVENT(usbtmc_log_header, usbtmc_header_send,
+	TP_PROTO(struct device *dev, const void *file, const u8 *header),
+	TP_ARGS(dev, file, header)
+);
+
+DEFINE_EVENT(usbtmc_log_header, usbtmc_header_recv,
+	TP_PROTO(struct device *dev, const void *file, const u8 *header),
+	TP_ARGS(dev, file, header)
+);
+
+/* steps of the CLEAR and ABORT_BULK_IN/OUT sequences */
+TRACE_EVENT(usbtmc_ctrl_request,
+	TP_PROTO(struct device *dev, u8 request, u16 value, int rv,
+		 const u8 *buffer),
+	TP_ARGS(dev, request, value, rv, buffer),
+	TP_STRUCT__entry(
+		__string(name, dev_name(dev))
+		__field(u8, request)
+		__field(u16, value)
+		__field(int, rv)
+		__field(u8, status)
+	),
+	TP_fast_assign(
+		__assign_str(name);
+		__entry->request = request;
+		__entry->value = value;
+		__entry->rv = rv;
+		__entry->status = rv > 0 ? buffer[0] : 0;
+	),
+	TP_printk("%s: bRequest %u wValue %u rv %d USBTMC_status 0x%02x",
+		  __get_str(name), __entry->request, __entry->value,
+		  __entry->rv, __entry->status)
+);
+
+/* SRQ notification of the interrupt endpoint */
+TRACE_EVENT(usbtmc_srq,
+	TP_PROTO(struct device *dev, u8 tag, u8 stb),
+	TP_ARGS(dev, tag, stb),
+	TP_STRUCT__entry(
+		__string(name, dev_name(dev))
+		__field(u8, tag)
+		__field(u8, stb)
+	),
+	TP_fast_assign(
+		__assign_str(name);
+		__entry->tag = tag;
+		__entry->stb = stb;
+	),
+	TP_printk("%s: bNotify1 0x%02x stb 0x%02x",
+		  __get_str(name), __entry->tag, __entry->stb)
+);
+
+#endif /* __USBTMC_TRACE_H */
+
+/* this part must be outside header guard */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usbtmc_trace
+
+#include <trace/define_trace.h>